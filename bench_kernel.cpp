@@ -0,0 +1,285 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <exception>
+#include <dirent.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+#include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "lib/CImg/CImg.h"
+
+using namespace std;
+
+static_assert(sizeof(CIMG_TYPE) == 1, "bench_kernel measures the 8-bit kernels");
+
+/**
+ * Hardware counter of the calling thread, read around each kernel call
+ */
+class hw_counter
+{
+private:
+    int _fd;
+
+public:
+    hw_counter(uint32_t type, uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~hw_counter()
+    {
+        if(_fd >= 0) close(_fd);
+    }
+
+    bool available()
+    {
+        return _fd >= 0;
+    }
+
+    void start()
+    {
+        if(_fd < 0) return;
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    long long stop()
+    {
+        if(_fd < 0) return 0;
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        long long count = 0;
+        if(read(_fd, &count, sizeof(count)) != sizeof(count)) return 0;
+        return count;
+    }
+};
+
+/**
+ * A stamp kernel under test
+ */
+struct bench_kernel_t
+{
+    string name;
+    iwm::stamp_kernel_t kernel;
+    iwm::kernel::run_kernel_t run;
+    iwm::kernel::bits_kernel_t bits;
+    double ms;
+    long long llc_misses;
+    long long l1d_misses;
+};
+
+/**
+ * Checks gray_scale and every supported run kernel against gray_scale_reference
+ * on all the 2^24 colors
+ */
+bool check_gray()
+{
+    const int n = 1 << 24;
+    vector<CIMG_TYPE> r(n), g(n), b(n);
+    for(int i = 0; i < n; i++)
+    {
+        r[i] = i & 255;
+        g[i] = (i >> 8) & 255;
+        b[i] = i >> 16;
+
+        if(iwm::gray_scale(r[i], g[i], b[i]) != iwm::gray_scale_reference(r[i], g[i], b[i]))
+        {
+            cerr << "gray_scale differs on (" << (int)r[i] << ", " << (int)g[i] << ", " << (int)b[i] << ")" << endl;
+            return false;
+        }
+    }
+
+    for(const iwm::kernel::entry_t &e : iwm::kernel::all())
+    {
+        if(!iwm::kernel::supported(e)) continue;
+
+        vector<CIMG_TYPE> cr(r), cg(g), cb(b);
+        e.run(cr.data(), cg.data(), cb.data(), n);
+        for(int i = 0; i < n; i++)
+        {
+            if(cr[i] != iwm::gray_scale_reference(r[i], g[i], b[i]) || cg[i] != cr[i] || cb[i] != cr[i])
+            {
+                cerr << e.name << " run kernel differs on (" << (int)r[i] << ", " << (int)g[i] << ", " << (int)b[i] << ")" << endl;
+                return false;
+            }
+        }
+    }
+
+    cout << "Gray scale: bit-exact on all colors" << endl;
+    return true;
+}
+
+/**
+ * Micro-benchmark of the stamp kernels: every kernel is applied to a fresh copy
+ * of each RGB image of the directory and its output is checked against the first one.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        cout << "usage: <imgDir> <stampFilename> [reps]" << endl;
+        return 0;
+    }
+
+    string imgDir = argv[1];
+    string stampFilename = argv[2];
+    int reps = argc > 3 ? atoi(argv[3]) : 5;
+    if(reps < 1) reps = 1;
+
+    if(!check_gray()) return 1;
+
+    cimg_library::CImg<CIMG_TYPE> stamp;
+    try
+    {
+        iwm::codec::load(stampFilename, stamp);
+    }
+    catch (cimg_library::CImgIOException &e)
+    {
+        cerr << "Cannot load stamp image " << stampFilename << "(" << e.what() << ")" << endl;
+        return 1;
+    }
+
+    vector<string *> filenames;
+    try
+    {
+        iwm::read_filenames(imgDir, filenames);
+    }
+    catch(...)
+    {
+        cerr << "Cannot open image directory " << imgDir << endl;
+        return 1;
+    }
+
+    vector<bench_kernel_t> kernels = {
+        { "columns", iwm::print_stamp_columns, NULL, NULL, 0, 0, 0 },
+    };
+    for(const iwm::kernel::entry_t &e : iwm::kernel::all())
+    {
+        if(iwm::kernel::supported(e)) kernels.push_back({ e.name, e.kernel, NULL, NULL, 0, 0, 0 });
+    }
+    for(const iwm::kernel::entry_t &e : iwm::kernel::all())
+    {
+        if(iwm::kernel::supported(e)) kernels.push_back({ string(e.name) + "+spans", NULL, e.run, NULL, 0, 0, 0 });
+    }
+    for(const iwm::kernel::entry_t &e : iwm::kernel::all())
+    {
+        if(iwm::kernel::supported(e)) kernels.push_back({ string(e.name) + "+bits", NULL, e.run, e.bits, 0, 0, 0 });
+    }
+
+    iwm::span_index spans(stamp);
+    iwm::stamp_bits bits(stamp);
+    cout << "Stamp spans: " << spans.count() << " (coverage " << spans.coverage() * 100 << "%)" << endl;
+    cout << "Stamp mask: " << stamp.size() << " bytes, packed " << bits.bytes() << " bytes" << endl;
+
+    hw_counter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    hw_counter l1d(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    int processed = 0, skipped = 0;
+    double mpixels = 0;
+    for(string *filepath : filenames)
+    {
+        cimg_library::CImg<CIMG_TYPE> original;
+        try
+        {
+            iwm::codec::load(*filepath, original);
+        }
+        catch (cimg_library::CImgIOException &e)
+        {
+            continue;
+        }
+
+        // the columns and vector kernels read three channels, print_stamp
+        // only runs them on RGB images
+        if(original.spectrum() != 3)
+        {
+            skipped++;
+            continue;
+        }
+
+        int width = min(original.width(), stamp.width());
+        int height = min(original.height(), stamp.height());
+
+        cimg_library::CImg<CIMG_TYPE> reference;
+        for(bench_kernel_t &k : kernels)
+        {
+            cimg_library::CImg<CIMG_TYPE> image;
+            for(int r = 0; r < reps; r++)
+            {
+                image = original;
+
+                llc.start();
+                l1d.start();
+                auto start = chrono::high_resolution_clock::now();
+                if(k.bits != NULL)
+                {
+                    k.bits(image, bits, k.run, 0, 0, width, height);
+                }
+                else if(k.run != NULL)
+                {
+                    iwm::kernel::print_stamp_spans(image, spans, k.run, 0, 0, width, height);
+                }
+                else
+                {
+                    k.kernel(image, stamp, 0, 0, width, height);
+                }
+                auto end = chrono::high_resolution_clock::now();
+                k.l1d_misses += l1d.stop();
+                k.llc_misses += llc.stop();
+
+                k.ms += chrono::duration<double, milli>(end - start).count();
+            }
+
+            if(reference.is_empty())
+            {
+                reference = image;
+            }
+            else if(image != reference)
+            {
+                cerr << "Kernel " << k.name << " differs from " << kernels[0].name << " on " << *filepath << endl;
+                return 1;
+            }
+        }
+
+        processed++;
+        mpixels += (double)width * height / 1e6;
+    }
+
+    cout << "---Kernels---" << endl;
+    cout << "Images: " << processed << ", reps: " << reps << ", Mpixels: " << mpixels << ", skipped (not RGB): " << skipped << endl;
+    cout << std::setw(14) << "kernel" << std::setw(14) << "ms/image" << std::setw(14) << "ms/Mpixel" << std::setw(10) << "speedup"
+         << std::setw(16) << "LLC miss/Mpx" << std::setw(16) << "L1d miss/Mpx" << endl;
+    for(bench_kernel_t &k : kernels)
+    {
+        double per_image = processed > 0 ? k.ms / reps / processed : 0;
+        double per_mpixel = mpixels > 0 ? k.ms / reps / mpixels : 0;
+        double speedup = k.ms > 0 ? kernels[0].ms / k.ms : 0;
+        cout << std::setw(14) << k.name << std::setw(14) << per_image << std::setw(14) << per_mpixel << std::setw(10) << speedup;
+        if(llc.available()) cout << std::setw(16) << (mpixels > 0 ? k.llc_misses / reps / mpixels : 0);
+        else cout << std::setw(16) << "n/a";
+        if(l1d.available()) cout << std::setw(16) << (mpixels > 0 ? k.l1d_misses / reps / mpixels : 0);
+        else cout << std::setw(16) << "n/a";
+        cout << endl;
+    }
+
+    for(string *filepath : filenames) delete filepath;
+
+    return 0;
+}
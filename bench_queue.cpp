@@ -0,0 +1,163 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "class/blocking_queue.cpp"
+#include "class/spsc_queue.cpp"
+#include "class/mpmc_queue.cpp"
+
+using namespace std;
+
+/**
+ * Results of one queue
+ */
+struct bench_queue_t
+{
+    string name;
+    double mmsg_s = 0;
+    double rtt_avg_ns = 0;
+    double rtt_p50_ns = 0;
+    double rtt_p99_ns = 0;
+};
+
+/**
+ * One producer pushes n values, one consumer pops them: millions of messages per second
+ */
+template <typename Q, typename... Args>
+double throughput(long n, Args... args)
+{
+    Q queue(args...);
+    long sum = 0;
+
+    auto start = chrono::high_resolution_clock::now();
+
+    thread consumer([&] {
+        for(long i = 0; i < n; i++) sum += queue.pop();
+    });
+    for(long i = 0; i < n; i++) queue.push(i);
+    consumer.join();
+
+    auto end = chrono::high_resolution_clock::now();
+
+    if(sum != n * (n - 1) / 2) cerr << "lost messages: " << sum << endl;
+
+    return n / chrono::duration<double, micro>(end - start).count();
+}
+
+/**
+ * Ping-pong between two threads over two queues: round trip times in ns
+ */
+template <typename Q, typename... Args>
+vector<double> round_trips(int rounds, Args... args)
+{
+    Q ping(args...);
+    Q pong(args...);
+    vector<double> rtt;
+    rtt.reserve(rounds);
+
+    thread echo([&] {
+        for(int i = 0; i < rounds; i++) pong.push(ping.pop());
+    });
+    for(int i = 0; i < rounds; i++)
+    {
+        auto start = chrono::high_resolution_clock::now();
+        ping.push(i);
+        pong.pop();
+        auto end = chrono::high_resolution_clock::now();
+        rtt.push_back(chrono::duration<double, nano>(end - start).count());
+    }
+    echo.join();
+
+    sort(rtt.begin(), rtt.end());
+    return rtt;
+}
+
+/**
+ * Fan-in: p producers push n values in total, one consumer pops them (the
+ * collector pattern). Millions of messages per second.
+ */
+template <typename Q, typename... Args>
+double fan_in(long n, int p, Args... args)
+{
+    Q queue(args...);
+    vector<thread> producers;
+    const long each = n / p;
+
+    auto start = chrono::high_resolution_clock::now();
+
+    for(int i = 0; i < p; i++)
+    {
+        producers.push_back(thread([&] {
+            for(long j = 0; j < each; j++) queue.push(j);
+        }));
+    }
+    for(long j = 0; j < each * p; j++) queue.pop();
+    for(thread &t : producers) t.join();
+
+    auto end = chrono::high_resolution_clock::now();
+
+    return each * p / chrono::duration<double, micro>(end - start).count();
+}
+
+template <typename Q, typename... Args>
+bench_queue_t bench(const string &name, long n, int rounds, Args... args)
+{
+    bench_queue_t b;
+    b.name = name;
+    b.mmsg_s = throughput<Q>(n, args...);
+
+    vector<double> rtt = round_trips<Q>(rounds, args...);
+    for(double t : rtt) b.rtt_avg_ns += t;
+    b.rtt_avg_ns /= rtt.size();
+    b.rtt_p50_ns = rtt[rtt.size() / 2];
+    b.rtt_p99_ns = rtt[rtt.size() * 99 / 100];
+    return b;
+}
+
+/**
+ * Main: blocking_queue against spsc_queue with every wait strategy, then
+ * against mpmc_queue with 1..64 producers
+ */
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 2000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    if(n < 1) n = 1;
+    if(rounds < 1) rounds = 1;
+
+    // a spinning side starves the other one without a core of its own
+    const bool can_spin = thread::hardware_concurrency() >= 2;
+
+    vector<bench_queue_t> results;
+    results.push_back(bench<blocking_queue<long>>("blocking", n, rounds));
+    results.push_back(bench<spsc_queue<long>>("spsc/park", n, rounds, (size_t)SPSC_CAPACITY, wait_strategy::park));
+    results.push_back(bench<spsc_queue<long>>("spsc/yield", n, rounds, (size_t)SPSC_CAPACITY, wait_strategy::yield));
+    if(can_spin) results.push_back(bench<spsc_queue<long>>("spsc/spin", n, rounds, (size_t)SPSC_CAPACITY, wait_strategy::spin));
+
+    cout << "---Queues---" << endl;
+    cout << "Messages: " << n << ", round trips: " << rounds << ", cpus: " << thread::hardware_concurrency() << endl;
+    cout << std::setw(12) << "queue" << std::setw(12) << "Mmsg/s" << std::setw(10) << "speedup"
+         << std::setw(14) << "RTT avg ns" << std::setw(14) << "RTT p50 ns" << std::setw(14) << "RTT p99 ns" << endl;
+    for(bench_queue_t &b : results)
+    {
+        cout << std::setw(12) << b.name << std::setw(12) << b.mmsg_s << std::setw(10) << b.mmsg_s / results[0].mmsg_s
+             << std::setw(14) << b.rtt_avg_ns << std::setw(14) << b.rtt_p50_ns << std::setw(14) << b.rtt_p99_ns << endl;
+    }
+    if(!can_spin) cout << std::setw(12) << "spsc/spin" << std::setw(12) << "n/a (1 cpu)" << endl;
+
+    cout << "---Fan-in (Mmsg/s)---" << endl;
+    cout << std::setw(10) << "producers" << std::setw(12) << "blocking" << std::setw(12) << "mpmc/park" << std::setw(12) << "mpmc/yield" << endl;
+    for(int p = 1; p <= 64; p *= 2)
+    {
+        cout << std::setw(10) << p
+             << std::setw(12) << fan_in<blocking_queue<long>>(n, p)
+             << std::setw(12) << fan_in<mpmc_queue<long>>(n, p, (size_t)MPMC_CAPACITY, wait_strategy::park)
+             << std::setw(12) << fan_in<mpmc_queue<long>>(n, p, (size_t)MPMC_CAPACITY, wait_strategy::yield) << endl;
+    }
+
+    return 0;
+}
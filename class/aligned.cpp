@@ -0,0 +1,40 @@
+#ifndef IWM_ALIGNED
+#define IWM_ALIGNED
+
+#include <cstdlib>
+#include <new>
+
+/**
+ * Base of the types padded to cache lines.
+ *
+ * Before C++17 operator new only guarantees the alignment of the
+ * fundamental types, so a type aligned to A gets these class-specific
+ * operators, which allocate it with posix_memalign.
+ */
+template <size_t A>
+struct aligned_new
+{
+    static void *operator new(size_t size)
+    {
+        void *p = NULL;
+        if(posix_memalign(&p, A, size) != 0) throw std::bad_alloc();
+        return p;
+    }
+
+    static void *operator new[](size_t size)
+    {
+        return operator new(size);
+    }
+
+    static void operator delete(void *p) noexcept
+    {
+        free(p);
+    }
+
+    static void operator delete[](void *p) noexcept
+    {
+        free(p);
+    }
+};
+
+#endif
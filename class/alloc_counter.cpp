@@ -0,0 +1,50 @@
+#ifndef IWM_ALLOC_COUNTER
+#define IWM_ALLOC_COUNTER
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+/**
+ * Counts the calls to the global operator new of the program.
+ *
+ * It replaces the global operator new/delete, so it must be included by
+ * the main file only. Allocations made with malloc (libjpeg) are not seen.
+ */
+namespace iwm
+{
+    namespace alloc_counter
+    {
+        std::atomic<long> _calls(0);
+
+        long calls()
+        {
+            return _calls.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void *operator new(size_t size)
+{
+    iwm::alloc_counter::_calls.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size > 0 ? size : 1);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+#endif
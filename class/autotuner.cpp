@@ -0,0 +1,188 @@
+#ifndef IWM_AUTOTUNER
+#define IWM_AUTOTUNER
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+
+using namespace std;
+
+/**
+ * Minimum throughput gain for a degree to be kept (5%)
+ */
+#ifndef TUNE_GAIN
+#define TUNE_GAIN 0.05
+#endif
+
+namespace iwm
+{
+    /**
+     * Throughput measured with a number of active workers
+     */
+    struct tune_step_t
+    {
+        int degree;
+        double throughput;
+    };
+
+    /**
+     * Runtime controller of the parallelism degree of a farm.
+     *
+     * The farm starts its maximum number of workers but only the first
+     * degree() of them take jobs, the others park before asking for the
+     * next one. The collector reports every departure; over each window of
+     * window x degree() departures the controller measures the throughput (from the mean
+     * inter-departure time, as the Ts of performance) and hill-climbs:
+     * it doubles the degree while the throughput improves by more than
+     * TUNE_GAIN, halves it instead when more workers than the start do not
+     * pay off, and settles on the best degree seen.
+     *
+     * Workers must pull their jobs (shared or steal dispatch), a job dealt
+     * to a parked worker would wait for the end of the stream.
+     */
+    class autotuner
+    {
+    private:
+        int _start;
+        int _max;
+        int _window;
+        atomic<int> _active;
+
+        /**
+         * Collector only
+         */
+        chrono::high_resolution_clock::time_point _mark;
+        chrono::high_resolution_clock::time_point _last;
+        int _departures = 0;
+
+        /**
+         * Departures of the jobs started before the last change, not measured
+         */
+        int _warmup = 0;
+
+        vector<tune_step_t> _trajectory;
+        tune_step_t _best = { 0, 0 };
+        int _direction = 1;
+        bool _converged = false;
+
+        bool _finished = false;
+        mutex _mutex;
+        condition_variable _changed;
+
+        void set(int degree)
+        {
+            _warmup = _active.load();
+            {
+                lock_guard<mutex> lock(_mutex);
+                _active.store(max(1, min(degree, _max)));
+            }
+            _changed.notify_all();
+        }
+
+        void measured(double throughput)
+        {
+            const int degree = _active.load();
+            _trajectory.push_back({ degree, throughput });
+
+            if(throughput > _best.throughput * (1 + TUNE_GAIN))
+            {
+                _best = { degree, throughput };
+            }
+            else if(_direction > 0 && _best.degree == _start)
+            {
+                // more workers than the start did not pay off, try fewer
+                _direction = -1;
+            }
+            else
+            {
+                _direction = 0;
+            }
+
+            if(_direction > 0 && _best.degree == _max) _direction = _best.degree == _start ? -1 : 0;
+
+            const int next = _direction > 0 ? min(_best.degree * 2, _max) : _direction < 0 ? max(_best.degree / 2, 1) : _best.degree;
+            if(next == _best.degree) _converged = true;
+            set(next);
+        }
+
+    public:
+        autotuner(int start, int max_workers, int window) : _start(max(1, min(start, max_workers))), _max(max_workers), _window(window)
+        {
+            _active.store(_start);
+            // the first jobs also pay the start up of the farm
+            _warmup = _start;
+        }
+
+        /**
+         * Worker i: waits while it is not among the active workers
+         */
+        void admit(int worker)
+        {
+            if(worker < _active.load(memory_order_relaxed)) return;
+
+            unique_lock<mutex> lock(_mutex);
+            _changed.wait(lock, [&] { return worker < _active.load() || _finished; });
+        }
+
+        /**
+         * Collector: a job left its worker at the given time (the collector
+         * gets the jobs in bursts, so its own clock is not used)
+         */
+        void departure(chrono::high_resolution_clock::time_point when)
+        {
+            if(_converged) return;
+
+            _last = max(_last, when);
+            if(_warmup > 0)
+            {
+                _warmup--;
+                _mark = _last;
+                return;
+            }
+
+            // every active worker finishes a few jobs in a window
+            const int window = _window * _active.load();
+            if(++_departures < window) return;
+
+            // jobs per second, from the mean inter-departure time since the
+            // end of the previous window
+            const double elapsed = chrono::duration<double>(_last - _mark).count();
+            _mark = _last;
+            _departures = 0;
+
+            measured(elapsed > 0 ? window / elapsed : 0);
+        }
+
+        /**
+         * End of the stream: every parked worker goes on to get its EOS
+         */
+        void finish()
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                _finished = true;
+            }
+            _changed.notify_all();
+        }
+
+        int degree() const
+        {
+            return _active.load();
+        }
+
+        bool converged() const
+        {
+            return _converged;
+        }
+
+        const vector<tune_step_t> &trajectory() const
+        {
+            return _trajectory;
+        }
+    };
+}
+
+#endif
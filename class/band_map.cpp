@@ -0,0 +1,162 @@
+#ifndef IWM_BAND_MAP
+#define IWM_BAND_MAP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+
+#include "../lib/CImg/CImg.h"
+#include "blocking_queue.cpp"
+
+/**
+ * Bands per map worker, more than one so uneven stamp coverage balances out
+ */
+#ifndef IWM_BANDS_PER_WORKER
+#define IWM_BANDS_PER_WORKER 4
+#endif
+
+/**
+ * Minimum height of a band, in rows
+ */
+#ifndef IWM_BAND_MIN_ROWS
+#define IWM_BAND_MIN_ROWS 16
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Data-parallel map of print_stamp over the rows of one image.
+     *
+     * The rows of the region are cut in bands that the calling thread and
+     * the pool workers claim one at a time until none is left, so a single
+     * large image is stamped by several cores. Many callers (e.g. farm
+     * workers) may share the same pool.
+     */
+    class band_map
+    {
+    private:
+        /**
+         * One mapped print_stamp call, shared by the caller and the helpers
+         */
+        struct batch_t
+        {
+            cimg_library::CImg<CIMG_TYPE> *image;
+            cimg_library::CImg<CIMG_TYPE> *stamp;
+            int left;
+            int top;
+            int width;
+            int height;
+
+            int rows;
+            int bands;
+            atomic<int> next;
+            atomic<bool> stamped;
+
+            mutex m;
+            condition_variable finished;
+            int done = 0;
+        };
+
+        int _workers;
+        blocking_queue<shared_ptr<batch_t>> _batches;
+        vector<thread *> _threads;
+
+        /**
+         * Stamps bands of the batch until none is left
+         */
+        static void run(batch_t &batch)
+        {
+            int band;
+            while((band = batch.next++) < batch.bands)
+            {
+                const int top = batch.top + band * batch.rows;
+                const int height = min(batch.rows, batch.top + batch.height - top);
+
+                if(iwm::print_stamp(*batch.image, *batch.stamp, batch.left, top, batch.width, height))
+                {
+                    batch.stamped = true;
+                }
+
+                unique_lock<mutex> lock(batch.m);
+                if(++batch.done == batch.bands) batch.finished.notify_one();
+            }
+        }
+
+        /**
+         * Map worker: helps the batches it receives, NULL terminates it
+         */
+        void worker()
+        {
+            shared_ptr<batch_t> batch = _batches.pop();
+            while(batch)
+            {
+                run(*batch);
+                batch = _batches.pop();
+            }
+        }
+
+    public:
+        band_map(int workers) : _workers(workers)
+        {
+            for(int i = 0; i < _workers; i++)
+            {
+                _threads.push_back(new thread(&band_map::worker, this));
+            }
+        }
+
+        ~band_map()
+        {
+            for(int i = 0; i < _workers; i++) _batches.push(shared_ptr<batch_t>());
+
+            for(thread *t : _threads)
+            {
+                t->join();
+                delete t;
+            }
+        }
+
+        int workers() const
+        {
+            return _workers;
+        }
+
+        /**
+         * Same contract as iwm::print_stamp, with the rows split in bands
+         */
+        bool print_stamp(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+        {
+            const int bands = min(IWM_BANDS_PER_WORKER * (_workers + 1), max(1, height / IWM_BAND_MIN_ROWS));
+            if(bands <= 1 || width <= 0) return iwm::print_stamp(image, stamp, left, top, width, height);
+
+            shared_ptr<batch_t> batch = make_shared<batch_t>();
+            batch->image = &image;
+            batch->stamp = &stamp;
+            batch->left = left;
+            batch->top = top;
+            batch->width = width;
+            batch->height = height;
+            batch->rows = (height + bands - 1) / bands;
+            batch->bands = (height + batch->rows - 1) / batch->rows;
+            batch->next = 0;
+            batch->stamped = false;
+
+            // late helpers only find the batch exhausted
+            const int helpers = min(_workers, batch->bands - 1);
+            for(int i = 0; i < helpers; i++) _batches.push(batch);
+
+            run(*batch);
+
+            unique_lock<mutex> lock(batch->m);
+            batch->finished.wait(lock, [&] { return batch->done == batch->bands; });
+
+            return batch->stamped;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef IWM_BITMASK
+#define IWM_BITMASK
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "../lib/CImg/CImg.h"
+
+/**
+ * Alignment (and row padding) of the packed mask, in bytes
+ */
+#define IWM_CACHE_LINE 64
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * 1 bit per pixel mask of the black pixels of a stamp.
+     *
+     * Bit x % 64 of word x / 64 of a row is set if the pixel is black. Rows
+     * are padded to whole cache lines and the buffer is cache-line aligned,
+     * so a 20 Mpixel stamp takes 2.5MB instead of 20MB (60MB for RGB).
+     */
+    class stamp_bits
+    {
+    private:
+        int _width;
+        int _height;
+
+        /**
+         * Words per row
+         */
+        int _stride;
+
+        uint64_t *_words = NULL;
+
+    public:
+        stamp_bits(const cimg_library::CImg<CIMG_TYPE> &stamp)
+        {
+            const int words_per_line = IWM_CACHE_LINE / sizeof(uint64_t);
+
+            _width = stamp.width();
+            _height = stamp.height();
+            _stride = ((_width + 63) / 64 + words_per_line - 1) / words_per_line * words_per_line;
+
+            size_t bytes = (size_t)_stride * _height * sizeof(uint64_t);
+            void *buffer = NULL;
+            if(posix_memalign(&buffer, IWM_CACHE_LINE, bytes > 0 ? bytes : IWM_CACHE_LINE) != 0)
+            {
+                throw bad_alloc();
+            }
+            _words = (uint64_t *)buffer;
+            memset(_words, 0, bytes);
+
+            for(int y = 0; y < _height; y++)
+            {
+                const CIMG_TYPE *s = stamp.data(0, y);
+                uint64_t *row = _words + (size_t)y * _stride;
+                for(int x = 0; x < _width; x++)
+                {
+                    if(s[x] == 0) row[x >> 6] |= (uint64_t)1 << (x & 63);
+                }
+            }
+        }
+
+        ~stamp_bits()
+        {
+            free(_words);
+        }
+
+        stamp_bits(const stamp_bits &) = delete;
+        stamp_bits &operator=(const stamp_bits &) = delete;
+
+        int width() const
+        {
+            return _width;
+        }
+
+        int height() const
+        {
+            return _height;
+        }
+
+        const uint64_t *row(int y) const
+        {
+            return _words + (size_t)y * _stride;
+        }
+
+        /**
+         * Size of the packed mask in bytes
+         */
+        size_t bytes() const
+        {
+            return (size_t)_stride * _height * sizeof(uint64_t);
+        }
+    };
+}
+
+#endif
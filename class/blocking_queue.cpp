@@ -10,7 +10,8 @@
 using namespace std;
 
 /**
- * Blocking queue used for thread communication
+ * Blocking queue used for thread communication.
+ * A non-zero capacity bounds it: push then blocks while the queue is full.
  */
 template <typename T>
 class blocking_queue
@@ -18,13 +19,23 @@ class blocking_queue
 private:
     mutex                d_mutex;
     condition_variable   d_condition;
+    condition_variable   d_not_full;
     deque<T>             d_deque;
+    size_t               d_capacity;
 
 public:
+    blocking_queue(size_t capacity = 0) : d_capacity(capacity)
+    {
+    }
+
     void push(T const &value)
     {
         {
             unique_lock<mutex> lock(this->d_mutex);
+            if(this->d_capacity > 0)
+            {
+                this->d_not_full.wait(lock, [ = ] { return this->d_deque.size() < this->d_capacity; });
+            }
             this->d_deque.push_front(value);
         }
         this->d_condition.notify_one();
@@ -37,9 +48,24 @@ public:
 
         T result(move(this->d_deque.back()));
         this->d_deque.pop_back();
+
+        if(this->d_capacity > 0)
+        {
+            lock.unlock();
+            this->d_not_full.notify_one();
+        }
         return result;
     }
 
+    /**
+     * Number of queued values, a hint only since other threads keep going
+     */
+    size_t size()
+    {
+        unique_lock<mutex> lock(this->d_mutex);
+        return this->d_deque.size();
+    }
+
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,383 @@
+#ifndef IWM_CODEC
+#define IWM_CODEC
+
+#include <cstdio>
+#include <csetjmp>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef IWM_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "../lib/CImg/CImg.h"
+
+#ifndef IWM_JPEG_QUALITY
+#define IWM_JPEG_QUALITY 100
+#endif
+
+/**
+ * Number of scanlines decoded/encoded by a single libjpeg call
+ */
+#define IWM_JPEG_ROWS 16
+
+/**
+ * Factor between 8-bit JPEG samples and CIMG_TYPE pixels (257 in 16-bit builds)
+ */
+#define IWM_JPEG_SCALE (iwm::pixel_traits<CIMG_TYPE>::white / 255)
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * In-process image codec used by the load and store stages.
+     *
+     * When compiled with IWM_JPEG, JPEG files are decoded and encoded
+     * directly through libjpeg into the planar CImg buffer. Any other
+     * format, or a build without IWM_JPEG, falls back to CImg's own
+     * loaders (which spawn an external converter for JPEG).
+     */
+    namespace codec
+    {
+        /**
+         * Returns true if the path has a JPEG extension
+         */
+        bool is_jpeg(const string &path)
+        {
+            size_t dot = path.find_last_of('.');
+            if(dot == string::npos) return false;
+
+            const char *ext = path.c_str() + dot + 1;
+            return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "jpe") == 0;
+        }
+
+#ifdef IWM_JPEG
+        /**
+         * libjpeg error manager: jumps back to the caller instead of exiting
+         */
+        struct jpeg_error_t
+        {
+            struct jpeg_error_mgr mgr;
+            jmp_buf jump;
+            char message[JMSG_LENGTH_MAX];
+        };
+
+        void jpeg_error_exit(j_common_ptr cinfo)
+        {
+            jpeg_error_t *err = (jpeg_error_t *)cinfo->err;
+            (*cinfo->err->format_message)(cinfo, err->message);
+            longjmp(err->jump, 1);
+        }
+
+        /**
+         * Decodes a JPEG file into the image, reusing its buffer when the size matches
+         */
+        void load_jpeg(const string &path, cimg_library::CImg<CIMG_TYPE> &image)
+        {
+            FILE *file = fopen(path.c_str(), "rb");
+            if(file == NULL)
+            {
+                throw cimg_library::CImgIOException("codec::load(): cannot open file '%s'.", path.c_str());
+            }
+
+            struct jpeg_decompress_struct cinfo;
+            jpeg_error_t jerr;
+            JSAMPLE *volatile buffer = NULL;
+
+            cinfo.err = jpeg_std_error(&jerr.mgr);
+            jerr.mgr.error_exit = jpeg_error_exit;
+            if(setjmp(jerr.jump))
+            {
+                jpeg_destroy_decompress(&cinfo);
+                delete[] buffer;
+                fclose(file);
+                throw cimg_library::CImgIOException("codec::load(): libjpeg error on '%s': %s.", path.c_str(), jerr.message);
+            }
+
+            jpeg_create_decompress(&cinfo);
+            jpeg_stdio_src(&cinfo, file);
+            jpeg_read_header(&cinfo, TRUE);
+
+            // CMYK/YCCK are left to CImg
+            if(cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+            {
+                jpeg_destroy_decompress(&cinfo);
+                fclose(file);
+                image.assign(path.c_str());
+                return;
+            }
+
+            jpeg_start_decompress(&cinfo);
+
+            const unsigned int w = cinfo.output_width;
+            const unsigned int h = cinfo.output_height;
+            const int c = cinfo.output_components;
+
+            image.assign(w, h, 1, c);
+            buffer = new JSAMPLE[(size_t)w * c * IWM_JPEG_ROWS];
+
+            JSAMPROW rows[IWM_JPEG_ROWS];
+            for(int i = 0; i < IWM_JPEG_ROWS; i++)
+            {
+                rows[i] = buffer + (size_t)i * w * c;
+            }
+
+            const size_t plane = (size_t)w * h;
+            while(cinfo.output_scanline < h)
+            {
+                const unsigned int y0 = cinfo.output_scanline;
+                const unsigned int n = jpeg_read_scanlines(&cinfo, rows, IWM_JPEG_ROWS);
+                if(n == 0) break;
+
+                // De-interleave the scanlines into the CImg planes
+                for(unsigned int r = 0; r < n; r++)
+                {
+                    const JSAMPLE *src = rows[r];
+                    CIMG_TYPE *dst = image.data() + (size_t)(y0 + r) * w;
+                    if(c == 1)
+                    {
+                        for(unsigned int x = 0; x < w; x++) dst[x] = src[x] * IWM_JPEG_SCALE;
+                    }
+                    else
+                    {
+                        for(unsigned int x = 0; x < w; x++, src += c)
+                        {
+                            for(int k = 0; k < c; k++) dst[k * plane + x] = src[k] * IWM_JPEG_SCALE;
+                        }
+                    }
+                }
+            }
+
+            jpeg_finish_decompress(&cinfo);
+            jpeg_destroy_decompress(&cinfo);
+            delete[] buffer;
+            fclose(file);
+        }
+
+        /**
+         * Encodes a gray or RGB image into a JPEG file, removed again when it
+         * cannot be written whole
+         */
+        void save_jpeg(const cimg_library::CImg<CIMG_TYPE> &image, const string &path, int quality)
+        {
+            FILE *file = fopen(path.c_str(), "wb");
+            if(file == NULL)
+            {
+                throw cimg_library::CImgIOException("codec::save(): cannot open file '%s'.", path.c_str());
+            }
+
+            struct jpeg_compress_struct cinfo;
+            jpeg_error_t jerr;
+            JSAMPLE *volatile buffer = NULL;
+
+            cinfo.err = jpeg_std_error(&jerr.mgr);
+            jerr.mgr.error_exit = jpeg_error_exit;
+            if(setjmp(jerr.jump))
+            {
+                jpeg_destroy_compress(&cinfo);
+                delete[] buffer;
+                fclose(file);
+                // a truncated output would pass for a valid one
+                unlink(path.c_str());
+                throw cimg_library::CImgIOException("codec::save(): libjpeg error on '%s': %s.", path.c_str(), jerr.message);
+            }
+
+            const unsigned int w = image.width();
+            const unsigned int h = image.height();
+            const int c = image.spectrum();
+
+            jpeg_create_compress(&cinfo);
+            jpeg_stdio_dest(&cinfo, file);
+            cinfo.image_width = w;
+            cinfo.image_height = h;
+            cinfo.input_components = c;
+            cinfo.in_color_space = c == 1 ? JCS_GRAYSCALE : JCS_RGB;
+            jpeg_set_defaults(&cinfo);
+            jpeg_set_quality(&cinfo, quality, TRUE);
+            jpeg_start_compress(&cinfo, TRUE);
+
+            buffer = new JSAMPLE[(size_t)w * c * IWM_JPEG_ROWS];
+
+            JSAMPROW rows[IWM_JPEG_ROWS];
+            for(int i = 0; i < IWM_JPEG_ROWS; i++)
+            {
+                rows[i] = buffer + (size_t)i * w * c;
+            }
+
+            const size_t plane = (size_t)w * h;
+            while(cinfo.next_scanline < h)
+            {
+                const unsigned int y0 = cinfo.next_scanline;
+                const unsigned int n = min((unsigned int)IWM_JPEG_ROWS, h - y0);
+
+                // Interleave the CImg planes into scanlines
+                for(unsigned int r = 0; r < n; r++)
+                {
+                    JSAMPLE *dst = rows[r];
+                    const CIMG_TYPE *src = image.data() + (size_t)(y0 + r) * w;
+                    if(c == 1)
+                    {
+                        for(unsigned int x = 0; x < w; x++) dst[x] = (JSAMPLE)(src[x] / IWM_JPEG_SCALE);
+                    }
+                    else
+                    {
+                        for(unsigned int x = 0; x < w; x++, dst += c)
+                        {
+                            for(int k = 0; k < c; k++) dst[k] = (JSAMPLE)(src[k * plane + x] / IWM_JPEG_SCALE);
+                        }
+                    }
+                }
+
+                jpeg_write_scanlines(&cinfo, rows, n);
+            }
+
+            jpeg_finish_compress(&cinfo);
+            jpeg_destroy_compress(&cinfo);
+            delete[] buffer;
+            if(fclose(file) != 0)
+            {
+                unlink(path.c_str());
+                throw cimg_library::CImgIOException("codec::save(): cannot write file '%s'.", path.c_str());
+            }
+        }
+#endif
+
+        /**
+         * Loads the image stored at path into image
+         */
+        void load(const string &path, cimg_library::CImg<CIMG_TYPE> &image)
+        {
+#ifdef IWM_JPEG
+            if(is_jpeg(path))
+            {
+                load_jpeg(path, image);
+                return;
+            }
+#endif
+            image.assign(path.c_str());
+        }
+
+        /**
+         * Loads the image stored at path into a new CImg
+         */
+        cimg_library::CImg<CIMG_TYPE> *load(const string &path)
+        {
+            cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>();
+            try
+            {
+                load(path, *image);
+            }
+            catch(...)
+            {
+                delete image;
+                throw;
+            }
+            return image;
+        }
+
+        /**
+         * Stores the image at path
+         */
+        void save(const cimg_library::CImg<CIMG_TYPE> &image, const string &path)
+        {
+            // the output may be a hard link shared with a duplicate input
+            unlink(path.c_str());
+#ifdef IWM_JPEG
+            if(is_jpeg(path) && (image.spectrum() == 1 || image.spectrum() == 3))
+            {
+                save_jpeg(image, path, IWM_JPEG_QUALITY);
+                return;
+            }
+#endif
+            try
+            {
+                image.save(path.c_str());
+            }
+            catch(const cimg_library::CImgException &)
+            {
+                unlink(path.c_str());
+                throw;
+            }
+        }
+
+        /**
+         * Reads the pixel size and the number of components of a JPEG from its
+         * SOF marker without decoding it. Returns false for other formats or a
+         * malformed header.
+         */
+        bool dimensions(const string &path, int &width, int &height, int &spectrum)
+        {
+            ifstream in(path, ios::binary);
+            if(!in || in.get() != 0xFF || in.get() != 0xD8) return false;
+
+            // big-endian 16 bit field
+            auto read16 = [&in]() {
+                const int hi = in.get();
+                const int lo = in.get();
+                return (hi << 8) | lo;
+            };
+
+            for(;;)
+            {
+                int c = in.get();
+                if(c != 0xFF) return false;
+
+                int marker;
+                while((marker = in.get()) == 0xFF);
+                if(marker == EOF || marker == 0xD9 || marker == 0xDA) return false;
+
+                // standalone markers carry no length
+                if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+
+                const int length = read16();
+                if(!in || length < 2) return false;
+
+                // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+                if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+                {
+                    in.get();  // sample precision
+                    height = read16();
+                    width = read16();
+                    spectrum = in.get();
+                    return (bool)in && width > 0 && height > 0 && spectrum > 0;
+                }
+
+                in.seekg(length - 2, ios::cur);
+            }
+        }
+
+        bool dimensions(const string &path, int &width, int &height)
+        {
+            int spectrum;
+            return dimensions(path, width, height, spectrum);
+        }
+
+        /**
+         * Stores an untouched image by copying the bytes of its source file
+         */
+        void copy(const string &src, const string &dst)
+        {
+            ifstream in(src, ios::binary);
+            unlink(dst.c_str());
+            bool copied;
+            {
+                ofstream out(dst, ios::binary | ios::trunc);
+                copied = in && out && (out << in.rdbuf()) && out.flush();
+                out.close();
+                copied = copied && !out.fail();
+            }
+            if(!copied)
+            {
+                // a truncated output would pass for a valid one
+                unlink(dst.c_str());
+                throw cimg_library::CImgIOException("codec::copy(): cannot copy '%s' to '%s'.", src.c_str(), dst.c_str());
+            }
+        }
+    }
+}
+
+#endif
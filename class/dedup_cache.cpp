@@ -0,0 +1,248 @@
+#ifndef IWM_DEDUP_CACHE
+#define IWM_DEDUP_CACHE
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <unistd.h>
+
+#include "hash.cpp"
+#include "codec.cpp"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Outputs of the inputs already seen, by content.
+     *
+     * A load worker hashes its input (XXH64 of its bytes, with its size)
+     * right before decoding it, so the hashing runs in parallel and the
+     * decoder finds the file in the page cache. The first input with a
+     * content is processed; a byte-identical one gets a hard link to its
+     * output (a copy across file systems) instead of being decoded, right
+     * away if the output is written or once the collector reports it
+     * otherwise. When the first input cannot be loaded its duplicates are
+     * dropped with it.
+     */
+    class dedup_cache
+    {
+    public:
+        enum result_t
+        {
+            MISS,
+            HIT,
+            DEFERRED
+        };
+
+    private:
+        struct key_t
+        {
+            uint64_t hash;
+            size_t size;
+
+            bool operator==(const key_t &other) const
+            {
+                return hash == other.hash && size == other.size;
+            }
+        };
+
+        struct key_hash
+        {
+            size_t operator()(const key_t &key) const
+            {
+                return key.hash;
+            }
+        };
+
+        struct entry_t
+        {
+            string output;
+            bool written = false;
+            double latency = 0;
+            vector<string *> duplicates;
+        };
+
+        unordered_map<key_t, entry_t, key_hash> _entries;
+
+        /**
+         * Content of the inputs being processed
+         */
+        unordered_map<string, key_t> _pending;
+
+        long _hits = 0;
+        long _misses = 0;
+        double _saved = 0;
+        double _hashing = 0;
+
+        mutex _mutex;
+
+        /**
+         * Gives the input the output of its content, false if neither a
+         * link nor a copy could be written
+         */
+        static bool link_output(const string &output, const string &input)
+        {
+            const string target = get_new_filename(input);
+            unlink(target.c_str());
+            if(link(output.c_str(), target.c_str()) == 0) return true;
+            try
+            {
+                codec::copy(output, target);
+                return true;
+            }
+            catch(...)
+            {
+                return false;
+            }
+        }
+
+    public:
+        /**
+         * Load worker: MISS if the input has to be processed, HIT if it got the
+         * output of an identical input (the caller still owns the path),
+         * DEFERRED if it will get it when that one is collected (the cache
+         * owns the path)
+         */
+        result_t lookup(string *input)
+        {
+            auto start = chrono::high_resolution_clock::now();
+            key_t key;
+            const bool hashed = hash::file(*input, key.hash, key.size);
+            const double elapsed = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+
+            unique_lock<mutex> lock(_mutex);
+            _hashing += elapsed;
+            if(!hashed)
+            {
+                _misses++;
+                return MISS;
+            }
+
+            auto found = _entries.find(key);
+            if(found == _entries.end())
+            {
+                _entries[key].output = get_new_filename(*input);
+                _pending[*input] = key;
+                _misses++;
+                return MISS;
+            }
+
+            entry_t &entry = found->second;
+            _hits++;
+            if(!entry.written)
+            {
+                entry.duplicates.push_back(input);
+                return DEFERRED;
+            }
+
+            _saved += entry.latency;
+            const string output = entry.output;
+            const double latency = entry.latency;
+            lock.unlock();
+
+            if(link_output(output, *input)) return HIT;
+
+            // no output for it: the input is processed on its own
+            lock.lock();
+            _hits--;
+            _misses++;
+            _saved -= latency;
+            return MISS;
+        }
+
+        /**
+         * Collector: the output of the input is written after latency ms.
+         * Returns the duplicates that got it, to be freed by the caller;
+         * the ones it could not be linked to are freed here and left for
+         * the next run.
+         */
+        vector<string *> done(const string &input, double latency)
+        {
+            vector<string *> duplicates;
+            string output;
+            {
+                lock_guard<mutex> lock(_mutex);
+                auto pending = _pending.find(input);
+                if(pending == _pending.end()) return duplicates;
+
+                entry_t &entry = _entries[pending->second];
+                _pending.erase(pending);
+
+                entry.written = true;
+                entry.latency = latency;
+                entry.duplicates.swap(duplicates);
+                _saved += latency * duplicates.size();
+                output = entry.output;
+            }
+
+            size_t linked = 0;
+            for(string *duplicate : duplicates)
+            {
+                if(link_output(output, *duplicate)) duplicates[linked++] = duplicate;
+                else delete duplicate;
+            }
+
+            if(linked < duplicates.size())
+            {
+                lock_guard<mutex> lock(_mutex);
+                _hits -= duplicates.size() - linked;
+                _saved -= latency * (duplicates.size() - linked);
+            }
+            duplicates.resize(linked);
+            return duplicates;
+        }
+
+        /**
+         * Load worker or collector: the input could not be loaded or its
+         * output not written, nor will its duplicates be
+         */
+        void failed(const string &input)
+        {
+            lock_guard<mutex> lock(_mutex);
+            auto pending = _pending.find(input);
+            if(pending == _pending.end()) return;
+
+            auto entry = _entries.find(pending->second);
+            _pending.erase(pending);
+
+            _hits -= entry->second.duplicates.size();
+            for(string *duplicate : entry->second.duplicates) delete duplicate;
+            _entries.erase(entry);
+        }
+
+        long hits()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _hits;
+        }
+
+        long misses()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _misses;
+        }
+
+        /**
+         * Latency (ms) of the jobs the hits did not run
+         */
+        double saved()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _saved;
+        }
+
+        /**
+         * Time (ms) spent hashing the inputs, summed over the load workers
+         */
+        double hashing()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _hashing;
+        }
+    };
+}
+
+#endif
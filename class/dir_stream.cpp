@@ -0,0 +1,123 @@
+#ifndef IWM_DIR_STREAM
+#define IWM_DIR_STREAM
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/**
+ * Bytes of directory entries read by one getdents64 call
+ */
+#ifndef DIR_BUFFER
+#define DIR_BUFFER (1UL << 20)
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Streaming enumeration of a directory.
+     *
+     * The entries are read with raw getdents64 calls into one large buffer
+     * and handed out one at a time, in directory order: the name points
+     * into the buffer, so nothing is allocated per entry and the caller
+     * can dispatch a file before the rest of the directory is read.
+     * The "." and ".." entries are skipped.
+     */
+    class dir_stream
+    {
+    private:
+        /**
+         * Record of getdents64, not exposed by every libc
+         */
+        struct entry_t
+        {
+            uint64_t d_ino;
+            int64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+
+        int _fd;
+        char *_buffer;
+        size_t _size;
+        long _pos = 0;
+        long _end = 0;
+        unsigned char _type = 0;
+        size_t _length = 0;
+
+    public:
+        dir_stream(const string &dir, size_t size = DIR_BUFFER) : _size(size)
+        {
+            _fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(_fd < 0) throw runtime_error("read_error");
+            _buffer = new char[_size];
+        }
+
+        /**
+         * Reads an open directory, the stream closes it
+         */
+        dir_stream(int fd, size_t size) : _fd(fd), _size(size)
+        {
+            _buffer = new char[_size];
+        }
+
+        ~dir_stream()
+        {
+            delete[] _buffer;
+            close(_fd);
+        }
+
+        /**
+         * Name of the next entry, NULL at the end of the directory. It is
+         * valid until the following call.
+         */
+        const char *next()
+        {
+            while(true)
+            {
+                if(_pos >= _end)
+                {
+                    _end = syscall(SYS_getdents64, _fd, _buffer, _size);
+                    _pos = 0;
+                    if(_end <= 0) return NULL;
+                }
+
+                entry_t *entry = (entry_t *)(_buffer + _pos);
+                _pos += entry->d_reclen;
+
+                const char *name = entry->d_name;
+                if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+                _type = entry->d_type;
+                _length = strlen(name);
+                return name;
+            }
+        }
+
+        /**
+         * Length of the name returned by next()
+         */
+        size_t length() const
+        {
+            return _length;
+        }
+
+        /**
+         * DT_* type of the entry returned by next(), DT_UNKNOWN when the
+         * file system does not tell
+         */
+        unsigned char type() const
+        {
+            return _type;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef IWM_DISPATCH
+#define IWM_DISPATCH
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <condition_variable>
+
+#include "performance.cpp"
+#include "blocking_queue.cpp"
+#include "mpmc_queue.cpp"
+#include "aligned.cpp"
+
+#ifndef EOS
+#define EOS NULL
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * How the emitter hands the jobs to the farm workers.
+     *
+     * The emitter pushes the jobs and closes the stream, worker i pops
+     * until it gets EOS.
+     */
+    class dispatcher
+    {
+    private:
+        /**
+         * Per-worker accounting, one cache line each
+         */
+        struct alignas(64) worker_clock_t : public aligned_new<64>
+        {
+            worker_stats_t stats;
+            time_entry last;
+            bool started = false;
+        };
+
+        /**
+         * An array, since std::allocator ignores the alignment too
+         */
+        worker_clock_t *_clocks;
+
+    protected:
+        int _workers;
+
+        /**
+         * Next job for worker i, EOS at the end of the stream
+         */
+        virtual Job *take(int worker) = 0;
+
+        /**
+         * Counts a job worker i got from another worker
+         */
+        void stolen(int worker)
+        {
+            _clocks[worker].stats.steals++;
+        }
+
+    public:
+        dispatcher(int workers) : _clocks(new worker_clock_t[workers]), _workers(workers)
+        {
+        }
+
+        virtual ~dispatcher()
+        {
+            delete[] _clocks;
+        }
+
+        /**
+         * Emitter only
+         */
+        virtual void push(Job *job) = 0;
+
+        /**
+         * Sends EOS to every worker
+         */
+        virtual void close() = 0;
+
+        /**
+         * Next job for worker i, EOS at the end of the stream. The time
+         * spent here is the idle time of the worker, the time between two
+         * calls its busy time.
+         */
+        Job *pop(int worker)
+        {
+            worker_clock_t &clock = _clocks[worker];
+
+            time_entry start = chrono::high_resolution_clock::now();
+            if(clock.started) clock.stats.busy += chrono::duration<double, milli>(start - clock.last).count();
+
+            Job *job = take(worker);
+
+            clock.last = chrono::high_resolution_clock::now();
+            clock.stats.idle += chrono::duration<double, milli>(clock.last - start).count();
+            clock.started = true;
+            if(job != EOS) clock.stats.jobs++;
+
+            return job;
+        }
+
+        /**
+         * Jobs waiting for worker i, a hint only
+         */
+        virtual size_t backlog(int worker) = 0;
+
+        int workers() const
+        {
+            return _workers;
+        }
+
+        /**
+         * Busy/idle times of the workers, once they all got EOS
+         */
+        vector<worker_stats_t> stats() const
+        {
+            vector<worker_stats_t> all;
+            for(int i = 0; i < _workers; i++) all.push_back(_clocks[i].stats);
+            return all;
+        }
+
+        static bool valid(const string &name)
+        {
+            return name == "rr" || name == "shared" || name == "steal" || name == "ondemand";
+        }
+
+        /**
+         * Builds the named policy, NULL if unknown
+         */
+        static dispatcher *create(const string &name, int workers, wait_strategy wait, int backlog = 1, int capacity = 0);
+    };
+
+    /**
+     * Static round robin over per-worker queues
+     */
+    class rr_dispatcher : public dispatcher
+    {
+    private:
+        vector<blocking_queue<Job *> *> _queues;
+        int _next = -1;
+
+    public:
+        rr_dispatcher(int workers, size_t capacity) : dispatcher(workers)
+        {
+            for(int i = 0; i < workers; i++) _queues.push_back(new blocking_queue<Job *>(capacity));
+        }
+
+        ~rr_dispatcher()
+        {
+            for(blocking_queue<Job *> *queue : _queues) delete queue;
+        }
+
+        void push(Job *job)
+        {
+            _next = (_next + 1) % _workers;
+#ifdef VERBOSE
+            cout << "send_to_worker: " << *job->getFilename() << ", idx: " << _next << endl;
+#endif
+            _queues[_next]->push(job);
+        }
+
+        void close()
+        {
+            for(blocking_queue<Job *> *queue : _queues) queue->push(EOS);
+        }
+
+        Job *take(int worker)
+        {
+            return _queues[worker]->pop();
+        }
+
+        size_t backlog(int worker)
+        {
+            return _queues[worker]->size();
+        }
+    };
+
+    /**
+     * One lock-free queue shared by all the workers: a free worker takes
+     * the oldest job
+     */
+    class shared_dispatcher : public dispatcher, public aligned_new<QUEUE_CACHE_LINE>
+    {
+    private:
+        mpmc_queue<Job *> _queue;
+
+    public:
+        shared_dispatcher(int workers, wait_strategy wait, size_t capacity) : dispatcher(workers), _queue(capacity, wait)
+        {
+        }
+
+        void push(Job *job)
+        {
+            _queue.push(job);
+        }
+
+        void close()
+        {
+            for(int i = 0; i < _workers; i++) _queue.push(EOS);
+        }
+
+        Job *take(int /* worker */)
+        {
+            return _queue.pop();
+        }
+
+        size_t backlog(int /* worker */)
+        {
+            return _queue.size() / _workers;
+        }
+    };
+
+    /**
+     * Work stealing: the emitter deals the jobs round robin to per-worker
+     * deques, a worker takes the oldest job of its own deque and, when it
+     * is empty, steals the newest job of a random victim. Workers with
+     * nothing to take or steal sleep until the next push.
+     */
+    class steal_dispatcher : public dispatcher
+    {
+    private:
+        struct alignas(64) deque_t : public aligned_new<64>
+        {
+            mutex m;
+            deque<Job *> jobs;
+        };
+
+        vector<deque_t *> _deques;
+        int _next = -1;
+
+        /**
+         * Jobs in all the deques
+         */
+        atomic<long> _queued;
+        bool _closed = false;
+
+        mutex _mutex;
+        condition_variable _available;
+
+        bool take_front(int worker, Job *&job)
+        {
+            deque_t *d = _deques[worker];
+            lock_guard<mutex> lock(d->m);
+            if(d->jobs.empty()) return false;
+            job = d->jobs.front();
+            d->jobs.pop_front();
+            _queued--;
+            return true;
+        }
+
+        bool steal_back(int victim, Job *&job)
+        {
+            deque_t *d = _deques[victim];
+            lock_guard<mutex> lock(d->m);
+            if(d->jobs.empty()) return false;
+            job = d->jobs.back();
+            d->jobs.pop_back();
+            _queued--;
+            return true;
+        }
+
+    protected:
+        Job *take(int worker)
+        {
+            static thread_local minstd_rand random(worker + 1);
+
+            Job *job;
+            for(;;)
+            {
+                if(take_front(worker, job)) return job;
+
+                // visit every other deque, starting from a random victim
+                const int first = random() % _workers;
+                for(int k = 0; k < _workers; k++)
+                {
+                    const int victim = (first + k) % _workers;
+                    if(victim != worker && steal_back(victim, job))
+                    {
+                        stolen(worker);
+                        return job;
+                    }
+                }
+
+                unique_lock<mutex> lock(_mutex);
+                _available.wait(lock, [&] { return _queued > 0 || _closed; });
+                if(_queued == 0 && _closed) return EOS;
+            }
+        }
+
+    public:
+        steal_dispatcher(int workers) : dispatcher(workers)
+        {
+            for(int i = 0; i < workers; i++) _deques.push_back(new deque_t());
+            _queued.store(0);
+        }
+
+        ~steal_dispatcher()
+        {
+            for(deque_t *d : _deques) delete d;
+        }
+
+        void push(Job *job)
+        {
+            _next = (_next + 1) % _workers;
+            {
+                lock_guard<mutex> lock(_deques[_next]->m);
+                _deques[_next]->jobs.push_back(job);
+                _queued++;
+            }
+
+            lock_guard<mutex> lock(_mutex);
+            _available.notify_one();
+        }
+
+        void close()
+        {
+            lock_guard<mutex> lock(_mutex);
+            _closed = true;
+            _available.notify_all();
+        }
+
+        size_t backlog(int worker)
+        {
+            deque_t *d = _deques[worker];
+            lock_guard<mutex> lock(d->m);
+            return d->jobs.size();
+        }
+    };
+
+    /**
+     * On demand: a worker asks for a job each time it takes one, the
+     * emitter waits for a request and sends the next job to that worker,
+     * so no worker ever has more than backlog jobs waiting.
+     */
+    class ondemand_dispatcher : public dispatcher, public aligned_new<QUEUE_CACHE_LINE>
+    {
+    private:
+        vector<blocking_queue<Job *> *> _queues;
+
+        /**
+         * Pending requests: ids of the workers with room for a job
+         */
+        mpmc_queue<int> _requests;
+
+    public:
+        ondemand_dispatcher(int workers, wait_strategy wait, int backlog) : dispatcher(workers), _requests(workers * backlog, wait)
+        {
+            for(int i = 0; i < workers; i++) _queues.push_back(new blocking_queue<Job *>());
+
+            for(int k = 0; k < backlog; k++)
+            {
+                for(int i = 0; i < workers; i++) _requests.push(i);
+            }
+        }
+
+        ~ondemand_dispatcher()
+        {
+            for(blocking_queue<Job *> *queue : _queues) delete queue;
+        }
+
+        void push(Job *job)
+        {
+            const int worker = _requests.pop();
+#ifdef VERBOSE
+            cout << "send_to_worker: " << *job->getFilename() << ", idx: " << worker << endl;
+#endif
+            _queues[worker]->push(job);
+        }
+
+        void close()
+        {
+            for(blocking_queue<Job *> *queue : _queues) queue->push(EOS);
+        }
+
+        Job *take(int worker)
+        {
+            Job *job = _queues[worker]->pop();
+            if(job != EOS) _requests.push(worker);
+            return job;
+        }
+
+        size_t backlog(int worker)
+        {
+            return _queues[worker]->size();
+        }
+    };
+
+    /**
+     * capacity bounds the queues of rr and shared (0: unbounded rr queues,
+     * MPMC_CAPACITY for shared); ondemand is bounded by its backlog and
+     * steal deques stay unbounded
+     */
+    dispatcher *dispatcher::create(const string &name, int workers, wait_strategy wait, int backlog, int capacity)
+    {
+        if(name == "rr") return new rr_dispatcher(workers, capacity);
+        if(name == "shared") return new shared_dispatcher(workers, wait, capacity > 0 ? capacity : MPMC_CAPACITY);
+        if(name == "steal") return new steal_dispatcher(workers);
+        if(name == "ondemand") return new ondemand_dispatcher(workers, wait, backlog);
+        return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef IWM_HASH
+#define IWM_HASH
+
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * XXH64 hash of a content: four lanes over the 32-byte stripes, then
+     * the tail. Not cryptographic, fast enough to hash whole images.
+     */
+    namespace hash
+    {
+        const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+        const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+        const uint64_t P3 = 0x165667B19E3779F9ULL;
+        const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+        const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+        inline uint64_t rotl(uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        inline uint64_t read64(const unsigned char *p)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint32_t read32(const unsigned char *p)
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint64_t round(uint64_t acc, uint64_t input)
+        {
+            acc += input * P2;
+            acc = rotl(acc, 31);
+            return acc * P1;
+        }
+
+        inline uint64_t merge(uint64_t acc, uint64_t lane)
+        {
+            acc ^= round(0, lane);
+            return acc * P1 + P4;
+        }
+
+        /**
+         * Incremental hash of a content fed in pieces of any size
+         */
+        class stream
+        {
+        private:
+            uint64_t _v[4];
+            uint64_t _seed;
+            uint64_t _length = 0;
+            unsigned char _stripe[32];
+            size_t _buffered = 0;
+
+            void consume(const unsigned char *p)
+            {
+                _v[0] = round(_v[0], read64(p));
+                _v[1] = round(_v[1], read64(p + 8));
+                _v[2] = round(_v[2], read64(p + 16));
+                _v[3] = round(_v[3], read64(p + 24));
+            }
+
+        public:
+            stream(uint64_t seed = 0) : _seed(seed)
+            {
+                _v[0] = seed + P1 + P2;
+                _v[1] = seed + P2;
+                _v[2] = seed;
+                _v[3] = seed - P1;
+            }
+
+            void update(const void *data, size_t length)
+            {
+                const unsigned char *p = (const unsigned char *)data;
+                const unsigned char *end = p + length;
+                _length += length;
+
+                // complete the stripe left by the previous piece
+                if(_buffered > 0)
+                {
+                    const size_t n = min(length, 32 - _buffered);
+                    memcpy(_stripe + _buffered, p, n);
+                    _buffered += n;
+                    p += n;
+                    if(_buffered < 32) return;
+                    consume(_stripe);
+                    _buffered = 0;
+                }
+
+                for(; p + 32 <= end; p += 32) consume(p);
+
+                _buffered = end - p;
+                memcpy(_stripe, p, _buffered);
+            }
+
+            uint64_t digest() const
+            {
+                uint64_t h;
+                if(_length >= 32)
+                {
+                    h = rotl(_v[0], 1) + rotl(_v[1], 7) + rotl(_v[2], 12) + rotl(_v[3], 18);
+                    for(int i = 0; i < 4; i++) h = merge(h, _v[i]);
+                }
+                else
+                {
+                    h = _seed + P5;
+                }
+
+                h += _length;
+                const unsigned char *p = _stripe;
+                const unsigned char *end = p + _buffered;
+                for(; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+                if(p + 4 <= end)
+                {
+                    h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+                    p += 4;
+                }
+                for(; p < end; p++) h = rotl(h ^ (*p * P5), 11) * P1;
+
+                h ^= h >> 33;
+                h *= P2;
+                h ^= h >> 29;
+                h *= P3;
+                h ^= h >> 32;
+                return h;
+            }
+        };
+
+        uint64_t bytes(const void *data, size_t length, uint64_t seed = 0)
+        {
+            stream h(seed);
+            h.update(data, length);
+            return h.digest();
+        }
+
+        /**
+         * Hash of the content of a file, computed while it is read; false
+         * if it cannot be read. The size of the file is returned too.
+         */
+        bool file(const string &path, uint64_t &h, size_t &size)
+        {
+            FILE *in = fopen(path.c_str(), "rb");
+            if(in == NULL) return false;
+
+            stream state;
+            unsigned char chunk[1 << 16];
+            size_t n;
+            size = 0;
+            while((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+            {
+                state.update(chunk, n);
+                size += n;
+            }
+            const bool ok = !ferror(in);
+            fclose(in);
+
+            h = state.digest();
+            return ok;
+        }
+
+        bool file(const string &path, uint64_t &h)
+        {
+            size_t size;
+            return file(path, h, size);
+        }
+    }
+}
+
+#endif
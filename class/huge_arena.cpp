@@ -0,0 +1,223 @@
+#ifndef IWM_HUGE_ARENA
+#define IWM_HUGE_ARENA
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "../lib/CImg/CImg.h"
+#include "codec.cpp"
+#include "aligned.cpp"
+
+/**
+ * Size of a huge page
+ */
+#define ARENA_PAGE (2UL << 20)
+
+/**
+ * Free regions a worker keeps for reuse, the others are unmapped
+ */
+#ifndef ARENA_KEEP
+#define ARENA_KEEP 4
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Pixel buffers of the decoded images in 2 MB huge pages.
+     *
+     * A region is a multiple of 2 MB, mapped anonymously and either backed
+     * by transparent huge pages (madvise MADV_HUGEPAGE) or by explicit ones
+     * (MAP_HUGETLB, falling back to transparent ones when the pool of the
+     * kernel is empty). It is pre-faulted by the worker that maps it, so
+     * the decoder writes to resident pages, and goes back to the free
+     * list of that worker when the job is collected.
+     *
+     * The decoded image shares the region (a shared CImg), so it is only
+     * used for JPEG files whose size and components the header tells;
+     * anything else is decoded into a heap image as usual.
+     */
+    class huge_arena
+    {
+    private:
+        struct region_t
+        {
+            size_t bytes;
+            int worker;
+        };
+
+        /**
+         * Free regions of a worker by size
+         */
+        struct alignas(64) worker_t : public aligned_new<64>
+        {
+            mutex m;
+            multimap<size_t, void *> free;
+        };
+
+        bool _explicit;
+        vector<worker_t *> _workers;
+
+        mutex _mutex;
+        unordered_map<void *, region_t> _regions;
+        long _mapped = 0;
+        long _reused = 0;
+        long _fallbacks = 0;
+
+        void *map_region(size_t bytes)
+        {
+            const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+            void *data = MAP_FAILED;
+            if(_explicit) data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+            if(data == MAP_FAILED)
+            {
+                if(_explicit)
+                {
+                    lock_guard<mutex> lock(_mutex);
+                    _fallbacks++;
+                }
+                data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+                if(data == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+                madvise(data, bytes, MADV_HUGEPAGE);
+#endif
+            }
+
+            // pre-fault: one write per small page, one fault per huge page
+            volatile char *page = (volatile char *)data;
+            for(size_t offset = 0; offset < bytes; offset += 4096) page[offset] = 0;
+            return data;
+        }
+
+        void *allocate(size_t bytes, int worker)
+        {
+            bytes = (bytes + ARENA_PAGE - 1) / ARENA_PAGE * ARENA_PAGE;
+            worker_t *w = _workers[worker % _workers.size()];
+            {
+                lock_guard<mutex> lock(w->m);
+                auto region = w->free.find(bytes);
+                if(region != w->free.end())
+                {
+                    void *data = region->second;
+                    w->free.erase(region);
+                    lock_guard<mutex> count(_mutex);
+                    _reused++;
+                    return data;
+                }
+            }
+
+            void *data = map_region(bytes);
+            if(data == NULL) return NULL;
+
+            lock_guard<mutex> lock(_mutex);
+            _regions[data] = { bytes, (int)(worker % _workers.size()) };
+            _mapped++;
+            return data;
+        }
+
+    public:
+        huge_arena(int workers, bool explicit_pages) : _explicit(explicit_pages)
+        {
+            for(int i = 0; i < max(workers, 1); i++) _workers.push_back(new worker_t());
+        }
+
+        ~huge_arena()
+        {
+            for(auto &region : _regions) munmap(region.first, region.second.bytes);
+            for(worker_t *w : _workers) delete w;
+        }
+
+        /**
+         * Decodes the image of worker i, in the arena when its buffer size
+         * is known in advance
+         */
+        cimg_library::CImg<CIMG_TYPE> *load(const string &path, int worker)
+        {
+#ifdef IWM_JPEG
+            int width, height, spectrum;
+            if(codec::is_jpeg(path) && codec::dimensions(path, width, height, spectrum) && (spectrum == 1 || spectrum == 3))
+            {
+                const size_t values = (size_t)width * height * spectrum;
+                CIMG_TYPE *data = (CIMG_TYPE *)allocate(values * sizeof(CIMG_TYPE), worker);
+                if(data != NULL)
+                {
+                    cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>(data, width, height, 1, spectrum, true);
+                    try
+                    {
+                        codec::load(path, *image);
+                    }
+                    catch(...)
+                    {
+                        release(image);
+                        delete image;
+                        throw;
+                    }
+                    return image;
+                }
+            }
+#endif
+            return codec::load(path);
+        }
+
+        /**
+         * Gives the buffer of an image back to the worker that mapped it;
+         * heap images are left alone. The image must be deleted afterwards.
+         */
+        void release(cimg_library::CImg<CIMG_TYPE> *image)
+        {
+            if(image == NULL || !image->is_shared()) return;
+
+            void *data = image->data();
+            region_t region;
+            {
+                lock_guard<mutex> lock(_mutex);
+                auto found = _regions.find(data);
+                if(found == _regions.end()) return;
+                region = found->second;
+            }
+
+            worker_t *w = _workers[region.worker];
+            {
+                lock_guard<mutex> lock(w->m);
+                if(w->free.size() < ARENA_KEEP)
+                {
+                    w->free.insert({ region.bytes, data });
+                    return;
+                }
+            }
+
+            munmap(data, region.bytes);
+            lock_guard<mutex> lock(_mutex);
+            _regions.erase(data);
+        }
+
+        /**
+         * Regions mapped, regions reused, explicit huge page mappings that
+         * fell back to transparent ones
+         */
+        long mapped()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _mapped;
+        }
+
+        long reused()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _reused;
+        }
+
+        long fallbacks()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _fallbacks;
+        }
+    };
+}
+
+#endif
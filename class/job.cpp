@@ -20,12 +20,32 @@ namespace iwm
         /**
          * Reference to the image to process
          */
-        cimg_library::CImg<CIMG_TYPE> *_image;
+        cimg_library::CImg<CIMG_TYPE> *_image = NULL;
 
         /**
          * Reference to the name of the original file
          */
-        string *_filename;
+        string *_filename = NULL;
+
+        /**
+         * False if the stamp left the image untouched
+         */
+        bool _stamped = true;
+
+        /**
+         * True if the rows of the image were split among the map workers
+         */
+        bool _mapped = false;
+
+        /**
+         * True if the output of the image was not written
+         */
+        bool _failed = false;
+
+        /**
+         * Bytes of the decoded image charged to the memory budget
+         */
+        size_t _charged = 0;
 
         /**
          * Where to store performance results
@@ -43,6 +63,21 @@ namespace iwm
             delete _filename;
         }
 
+        /**
+         * Forgets the image and the filename, which the caller took back,
+         * so that the job can be reused
+         */
+        void reset()
+        {
+            _image = NULL;
+            _filename = NULL;
+            _stamped = true;
+            _mapped = false;
+            _failed = false;
+            _charged = 0;
+            _perf_entry = perf_entry_t();
+        }
+
         void setImage(cimg_library::CImg<CIMG_TYPE> *image)
         {
             _image = image;
@@ -63,6 +98,46 @@ namespace iwm
             return _filename;
         }
 
+        void setStamped(bool stamped)
+        {
+            _stamped = stamped;
+        }
+
+        bool isStamped()
+        {
+            return _stamped;
+        }
+
+        void setMapped(bool mapped)
+        {
+            _mapped = mapped;
+        }
+
+        bool isMapped()
+        {
+            return _mapped;
+        }
+
+        void setFailed(bool failed)
+        {
+            _failed = failed;
+        }
+
+        bool isFailed()
+        {
+            return _failed;
+        }
+
+        void setCharged(size_t charged)
+        {
+            _charged = charged;
+        }
+
+        size_t getCharged()
+        {
+            return _charged;
+        }
+
         perf_entry_t getPerfEntry()
         {
             return _perf_entry;
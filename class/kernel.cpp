@@ -0,0 +1,535 @@
+#ifndef IWM_KERNEL
+#define IWM_KERNEL
+
+#include <string>
+#include <vector>
+#include <immintrin.h>
+
+#include "../lib/CImg/CImg.h"
+#include "stamp_cache.cpp"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Vectorized stamp kernels and their runtime selection.
+     *
+     * Every kernel is compiled for its own instruction set through target
+     * attributes, so a single binary runs on any x86-64 host: use("auto")
+     * picks the widest kernel the CPU supports. The gray value is computed
+     * on 16-bit lanes with the same multiply-shift as gray_sum, as the high
+     * half of (sum + 765) * 10923.
+     *
+     * Each instruction set comes in two flavours: a masked kernel that tests
+     * the stamp pixel by pixel, and a run kernel that grays a whole span of
+     * the stamp's span_index unconditionally. The packed stamp_bits mask is
+     * consumed one 64-pixel word at a time, either as AVX-512 store masks or
+     * split into runs for the narrower instruction sets.
+     *
+     * The vectorized kernels work on the three planes of 8-bit RGB(A)
+     * images; gray images and 16-bit builds (IWM_PIXEL16) only have the
+     * scalar kernels specialized by print_stamp_rows.
+     */
+    namespace kernel
+    {
+        /**
+         * Signature of a run kernel: grays n consecutive pixels
+         */
+        typedef void (*run_kernel_t)(CIMG_TYPE *, CIMG_TYPE *, CIMG_TYPE *, int);
+
+        /**
+         * Scalar run kernel
+         */
+        void gray_run(CIMG_TYPE *r, CIMG_TYPE *g, CIMG_TYPE *b, int n)
+        {
+            for (int x = 0; x < n; x++)
+            {
+                CIMG_TYPE a = gray_sum_t<CIMG_TYPE>(r[x] + g[x] + b[x]);
+                r[x] = a;
+                g[x] = a;
+                b[x] = a;
+            }
+        }
+
+#ifndef IWM_PIXEL16
+        /**
+         * Scalar tail of a row, shared by all vectorized kernels
+         */
+        inline void stamp_tail(const CIMG_TYPE *s, CIMG_TYPE *r, CIMG_TYPE *g, CIMG_TYPE *b, int x, int endw)
+        {
+            for (; x < endw; x++)
+            {
+                if (s[x] == 0)
+                {
+                    CIMG_TYPE a = gray_scale(r[x], g[x], b[x]);
+                    r[x] = a;
+                    g[x] = a;
+                    b[x] = a;
+                }
+            }
+        }
+
+        /**
+         * SSE4.1: 16 pixels per iteration
+         */
+        __attribute__((target("sse4.1")))
+        inline __m128i gray_sse4(__m128i r, __m128i g, __m128i b)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i magic = _mm_set1_epi16(10923);
+            const __m128i bias = _mm_set1_epi16(765);
+
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero)), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero)), _mm_unpackhi_epi8(b, zero));
+
+            lo = _mm_mulhi_epu16(_mm_add_epi16(lo, bias), magic);
+            hi = _mm_mulhi_epu16(_mm_add_epi16(hi, bias), magic);
+
+            return _mm_packus_epi16(lo, hi);
+        }
+
+        __attribute__((target("sse4.1")))
+        void print_stamp_sse4(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+        {
+            const int endw = left + width;
+            const int endh = top + height;
+            const size_t plane = (size_t)image.width() * image.height();
+            const __m128i zero = _mm_setzero_si128();
+
+            for (int y = top; y < endh; y++)
+            {
+                const CIMG_TYPE *s = stamp.data(0, y);
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                int x = left;
+                for (; x + 16 <= endw; x += 16)
+                {
+                    __m128i mask = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + x)), zero);
+                    if (_mm_testz_si128(mask, mask)) continue;
+
+                    __m128i vr = _mm_loadu_si128((const __m128i *)(r + x));
+                    __m128i vg = _mm_loadu_si128((const __m128i *)(g + x));
+                    __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+                    __m128i a = gray_sse4(vr, vg, vb);
+
+                    _mm_storeu_si128((__m128i *)(r + x), _mm_blendv_epi8(vr, a, mask));
+                    _mm_storeu_si128((__m128i *)(g + x), _mm_blendv_epi8(vg, a, mask));
+                    _mm_storeu_si128((__m128i *)(b + x), _mm_blendv_epi8(vb, a, mask));
+                }
+
+                stamp_tail(s, r, g, b, x, endw);
+            }
+        }
+
+        __attribute__((target("sse4.1")))
+        void gray_run_sse4(CIMG_TYPE *r, CIMG_TYPE *g, CIMG_TYPE *b, int n)
+        {
+            int x = 0;
+            for (; x + 16 <= n; x += 16)
+            {
+                __m128i a = gray_sse4(_mm_loadu_si128((const __m128i *)(r + x)),
+                                      _mm_loadu_si128((const __m128i *)(g + x)),
+                                      _mm_loadu_si128((const __m128i *)(b + x)));
+                _mm_storeu_si128((__m128i *)(r + x), a);
+                _mm_storeu_si128((__m128i *)(g + x), a);
+                _mm_storeu_si128((__m128i *)(b + x), a);
+            }
+            gray_run(r + x, g + x, b + x, n - x);
+        }
+
+        /**
+         * AVX2: 32 pixels per iteration
+         */
+        __attribute__((target("avx2")))
+        inline __m256i gray_avx2(__m256i r, __m256i g, __m256i b)
+        {
+            const __m256i magic = _mm256_set1_epi16(10923);
+            const __m256i bias = _mm256_set1_epi16(765);
+
+            __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+                             _mm256_cvtepu8_epi16(_mm256_castsi256_si128(r)),
+                             _mm256_cvtepu8_epi16(_mm256_castsi256_si128(g))),
+                             _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+            __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+                             _mm256_cvtepu8_epi16(_mm256_extracti128_si256(r, 1)),
+                             _mm256_cvtepu8_epi16(_mm256_extracti128_si256(g, 1))),
+                             _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+
+            lo = _mm256_mulhi_epu16(_mm256_add_epi16(lo, bias), magic);
+            hi = _mm256_mulhi_epu16(_mm256_add_epi16(hi, bias), magic);
+
+            // packus works per 128-bit lane: restore the pixel order
+            return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+        }
+
+        __attribute__((target("avx2")))
+        void print_stamp_avx2(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+        {
+            const int endw = left + width;
+            const int endh = top + height;
+            const size_t plane = (size_t)image.width() * image.height();
+            const __m256i zero = _mm256_setzero_si256();
+
+            for (int y = top; y < endh; y++)
+            {
+                const CIMG_TYPE *s = stamp.data(0, y);
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                int x = left;
+                for (; x + 32 <= endw; x += 32)
+                {
+                    __m256i mask = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + x)), zero);
+                    if (_mm256_testz_si256(mask, mask)) continue;
+
+                    __m256i vr = _mm256_loadu_si256((const __m256i *)(r + x));
+                    __m256i vg = _mm256_loadu_si256((const __m256i *)(g + x));
+                    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + x));
+                    __m256i a = gray_avx2(vr, vg, vb);
+
+                    _mm256_storeu_si256((__m256i *)(r + x), _mm256_blendv_epi8(vr, a, mask));
+                    _mm256_storeu_si256((__m256i *)(g + x), _mm256_blendv_epi8(vg, a, mask));
+                    _mm256_storeu_si256((__m256i *)(b + x), _mm256_blendv_epi8(vb, a, mask));
+                }
+
+                stamp_tail(s, r, g, b, x, endw);
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void gray_run_avx2(CIMG_TYPE *r, CIMG_TYPE *g, CIMG_TYPE *b, int n)
+        {
+            int x = 0;
+            for (; x + 32 <= n; x += 32)
+            {
+                __m256i a = gray_avx2(_mm256_loadu_si256((const __m256i *)(r + x)),
+                                      _mm256_loadu_si256((const __m256i *)(g + x)),
+                                      _mm256_loadu_si256((const __m256i *)(b + x)));
+                _mm256_storeu_si256((__m256i *)(r + x), a);
+                _mm256_storeu_si256((__m256i *)(g + x), a);
+                _mm256_storeu_si256((__m256i *)(b + x), a);
+            }
+            gray_run(r + x, g + x, b + x, n - x);
+        }
+
+        /**
+         * AVX-512BW: 64 pixels per iteration, masked stores instead of blends
+         */
+        __attribute__((target("avx512f,avx512bw")))
+        inline __m512i gray_avx512(__m512i r, __m512i g, __m512i b)
+        {
+            const __m512i magic = _mm512_set1_epi16(10923);
+            const __m512i bias = _mm512_set1_epi16(765);
+
+            __m512i lo = _mm512_add_epi16(_mm512_add_epi16(
+                             _mm512_cvtepu8_epi16(_mm512_castsi512_si256(r)),
+                             _mm512_cvtepu8_epi16(_mm512_castsi512_si256(g))),
+                             _mm512_cvtepu8_epi16(_mm512_castsi512_si256(b)));
+            __m512i hi = _mm512_add_epi16(_mm512_add_epi16(
+                             _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(r, 1)),
+                             _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(g, 1))),
+                             _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(b, 1)));
+
+            lo = _mm512_mulhi_epu16(_mm512_add_epi16(lo, bias), magic);
+            hi = _mm512_mulhi_epu16(_mm512_add_epi16(hi, bias), magic);
+
+            return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi16_epi8(lo)), _mm512_cvtepi16_epi8(hi), 1);
+        }
+
+        __attribute__((target("avx512f,avx512bw")))
+        void print_stamp_avx512(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+        {
+            const int endw = left + width;
+            const int endh = top + height;
+            const size_t plane = (size_t)image.width() * image.height();
+            const __m512i zero = _mm512_setzero_si512();
+
+            for (int y = top; y < endh; y++)
+            {
+                const CIMG_TYPE *s = stamp.data(0, y);
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                int x = left;
+                for (; x + 64 <= endw; x += 64)
+                {
+                    __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(s + x)), zero);
+                    if (mask == 0) continue;
+
+                    __m512i a = gray_avx512(_mm512_loadu_si512((const void *)(r + x)),
+                                            _mm512_loadu_si512((const void *)(g + x)),
+                                            _mm512_loadu_si512((const void *)(b + x)));
+
+                    _mm512_mask_storeu_epi8((void *)(r + x), mask, a);
+                    _mm512_mask_storeu_epi8((void *)(g + x), mask, a);
+                    _mm512_mask_storeu_epi8((void *)(b + x), mask, a);
+                }
+
+                stamp_tail(s, r, g, b, x, endw);
+            }
+        }
+
+        __attribute__((target("avx512f,avx512bw")))
+        void gray_run_avx512(CIMG_TYPE *r, CIMG_TYPE *g, CIMG_TYPE *b, int n)
+        {
+            int x = 0;
+            for (; x < n; x += 64)
+            {
+                // the last chunk is handled with a partial mask
+                __mmask64 mask = n - x >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << (n - x)) - 1);
+                __m512i a = gray_avx512(_mm512_maskz_loadu_epi8(mask, (const void *)(r + x)),
+                                        _mm512_maskz_loadu_epi8(mask, (const void *)(g + x)),
+                                        _mm512_maskz_loadu_epi8(mask, (const void *)(b + x)));
+                _mm512_mask_storeu_epi8((void *)(r + x), mask, a);
+                _mm512_mask_storeu_epi8((void *)(g + x), mask, a);
+                _mm512_mask_storeu_epi8((void *)(b + x), mask, a);
+            }
+        }
+
+#endif
+
+        /**
+         * Prints the stamp through its span index: only the pixels inside the
+         * black runs intersecting the range are touched.
+         */
+        void print_stamp_spans(cimg_library::CImg<CIMG_TYPE> &image, const span_index &index, run_kernel_t run, int left, int top, int width, int height)
+        {
+            const int endw = left + width;
+            const int endh = min(top + height, index.height());
+            const size_t plane = (size_t)image.width() * image.height();
+
+            for (int y = top; y < endh; y++)
+            {
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                for (const span_t *sp = index.row_begin(y); sp != index.row_end(y); sp++)
+                {
+                    int x0 = max(sp->start, left);
+                    int x1 = min(sp->start + sp->length, endw);
+                    if (x0 < x1) run(r + x0, g + x0, b + x0, x1 - x0);
+                }
+            }
+        }
+
+        /**
+         * Signature of a kernel over the packed stamp mask
+         */
+        typedef void (*bits_kernel_t)(cimg_library::CImg<CIMG_TYPE> &, const stamp_bits &, run_kernel_t, int, int, int, int);
+
+        /**
+         * Bits of the word starting at pixel base that fall inside [left, endw)
+         */
+        inline uint64_t word_range(int base, int left, int endw)
+        {
+            int lo = max(left - base, 0);
+            int hi = min(endw - base, 64);
+            if (lo >= hi) return 0;
+
+            uint64_t upto = hi == 64 ? ~(uint64_t)0 : (((uint64_t)1 << hi) - 1);
+            return upto & (~(uint64_t)0 << lo);
+        }
+
+        /**
+         * Prints the stamp through its packed mask: every 64-pixel word is split
+         * into its runs of set bits, each one grayed by the run kernel
+         */
+        void print_stamp_bits(cimg_library::CImg<CIMG_TYPE> &image, const stamp_bits &mask, run_kernel_t run, int left, int top, int width, int height)
+        {
+            const int endw = min(left + width, mask.width());
+            const int endh = min(top + height, mask.height());
+            const size_t plane = (size_t)image.width() * image.height();
+
+            for (int y = top; y < endh; y++)
+            {
+                const uint64_t *words = mask.row(y);
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                for (int base = left & ~63; base < endw; base += 64)
+                {
+                    uint64_t word = words[base >> 6] & word_range(base, left, endw);
+                    while (word != 0)
+                    {
+                        int tz = __builtin_ctzll(word);
+                        uint64_t rest = ~(word >> tz);
+                        int len = rest == 0 ? 64 - tz : __builtin_ctzll(rest);
+
+                        int x = base + tz;
+                        run(r + x, g + x, b + x, len);
+
+                        word &= len + tz == 64 ? 0 : (~(uint64_t)0 << (len + tz));
+                    }
+                }
+            }
+        }
+
+#ifndef IWM_PIXEL16
+        /**
+         * AVX-512BW: every word of the packed mask is the store mask of 64 pixels
+         */
+        __attribute__((target("avx512f,avx512bw")))
+        void print_stamp_bits_avx512(cimg_library::CImg<CIMG_TYPE> &image, const stamp_bits &mask, run_kernel_t, int left, int top, int width, int height)
+        {
+            const int endw = min(left + width, mask.width());
+            const int endh = min(top + height, mask.height());
+            const size_t plane = (size_t)image.width() * image.height();
+
+            for (int y = top; y < endh; y++)
+            {
+                const uint64_t *words = mask.row(y);
+                CIMG_TYPE *r = image.data(0, y);
+                CIMG_TYPE *g = r + plane;
+                CIMG_TYPE *b = g + plane;
+
+                for (int base = left & ~63; base < endw; base += 64)
+                {
+                    __mmask64 m = words[base >> 6] & word_range(base, left, endw);
+                    if (m == 0) continue;
+
+                    // masked loads never touch the pixels past the row
+                    __m512i a = gray_avx512(_mm512_maskz_loadu_epi8(m, (const void *)(r + base)),
+                                            _mm512_maskz_loadu_epi8(m, (const void *)(g + base)),
+                                            _mm512_maskz_loadu_epi8(m, (const void *)(b + base)));
+                    _mm512_mask_storeu_epi8((void *)(r + base), m, a);
+                    _mm512_mask_storeu_epi8((void *)(g + base), m, a);
+                    _mm512_mask_storeu_epi8((void *)(b + base), m, a);
+                }
+            }
+        }
+
+#endif
+
+        /**
+         * A selectable kernel
+         */
+        struct entry_t
+        {
+            const char *name;
+            const char *isa;
+            stamp_kernel_t kernel;
+            run_kernel_t run;
+            bits_kernel_t bits;
+        };
+
+        /**
+         * All kernels, from the narrowest to the widest
+         */
+        const vector<entry_t> &all()
+        {
+            static const vector<entry_t> kernels = {
+                { "scalar", NULL, print_stamp_rows, gray_run, print_stamp_bits },
+#ifndef IWM_PIXEL16
+                { "sse4", "sse4.1", print_stamp_sse4, gray_run_sse4, print_stamp_bits },
+                { "avx2", "avx2", print_stamp_avx2, gray_run_avx2, print_stamp_bits },
+                { "avx512", "avx512bw", print_stamp_avx512, gray_run_avx512, print_stamp_bits_avx512 },
+#endif
+            };
+            return kernels;
+        }
+
+        /**
+         * Returns true if the CPU can run the kernel
+         */
+        bool supported(const entry_t &e)
+        {
+            if (e.isa == NULL) return true;
+
+            __builtin_cpu_init();
+            if (strcmp(e.isa, "sse4.1") == 0) return __builtin_cpu_supports("sse4.1");
+            if (strcmp(e.isa, "avx2") == 0) return __builtin_cpu_supports("avx2");
+            if (strcmp(e.isa, "avx512bw") == 0) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+            return false;
+        }
+
+        /**
+         * Name of the kernel currently used by print_stamp
+         */
+        string active = "scalar";
+
+        /**
+         * Kernels of the active instruction set
+         */
+        stamp_kernel_t active_mask = print_stamp_rows;
+        run_kernel_t active_run = gray_run;
+        bits_kernel_t active_bits = print_stamp_bits;
+
+        /**
+         * Entry point installed in stamp_entry: fits the stamp to the image
+         * through its stamp_cache, clips the range to the stamp's bounding box
+         * and goes through the span index or the packed mask when compiled,
+         * through the masked kernel otherwise
+         */
+        bool print_stamp_active(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+        {
+            // gray and gray+alpha images only have the scalar kernels
+            const bool rgb = image.spectrum() >= 3;
+
+            stamp_cache *cache = stamp_cache::find(stamp);
+            if (cache == NULL)
+            {
+                if (rgb) active_mask(image, stamp, left, top, width, height);
+                else print_stamp_rows(image, stamp, left, top, width, height);
+                return width > 0 && height > 0;
+            }
+
+            fitted_stamp_t &fitted = cache->fit(image.width(), image.height());
+
+            const int x0 = max(left, fitted.left);
+            const int y0 = max(top, fitted.top);
+            const int x1 = min(left + width, fitted.right);
+            const int y1 = min(top + height, fitted.bottom);
+            if (x0 >= x1 || y0 >= y1) return false;
+
+            if (!rgb)
+            {
+                print_stamp_rows(image, fitted.mask, x0, y0, x1 - x0, y1 - y0);
+            }
+            else if (fitted.spans != NULL)
+            {
+                print_stamp_spans(image, *fitted.spans, active_run, x0, y0, x1 - x0, y1 - y0);
+            }
+            else if (fitted.bits != NULL)
+            {
+                active_bits(image, *fitted.bits, active_run, x0, y0, x1 - x0, y1 - y0);
+            }
+            else
+            {
+                active_mask(image, fitted.mask, x0, y0, x1 - x0, y1 - y0);
+            }
+            return true;
+        }
+
+        /**
+         * Selects the kernel used by print_stamp: "auto" picks the widest supported one.
+         * Returns false if the name is unknown or the CPU cannot run it.
+         */
+        bool use(const string &name)
+        {
+            const vector<entry_t> &kernels = all();
+            for (int i = kernels.size() - 1; i >= 0; i--)
+            {
+                const entry_t &e = kernels[i];
+                if ((name == "auto" || name == e.name) && supported(e))
+                {
+                    active_mask = e.kernel;
+                    active_run = e.run;
+                    active_bits = e.bits;
+                    active = e.name;
+                    stamp_entry = print_stamp_active;
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+}
+
+#endif
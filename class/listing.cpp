@@ -0,0 +1,105 @@
+#ifndef IWM_LISTING
+#define IWM_LISTING
+
+#include <string>
+#include <vector>
+#include <dirent.h>
+
+#include "dir_stream.cpp"
+#include "tree_walker.cpp"
+#include "manifest.cpp"
+#include "pool.cpp"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Listing of the inputs shared by the emitters.
+     *
+     * The files of the image directory, or of the tree below it when there
+     * are walkers, either streamed to the caller as they are read or
+     * gathered in a batch. Outputs are never listed and, in incremental
+     * mode, the inputs whose output is up to date go back to the pool of
+     * paths instead of being listed.
+     */
+    namespace listing
+    {
+        /**
+         * Gives a path that is not listed back to the pool
+         */
+        void drop(string *filepath, object_pool<string> *paths)
+        {
+            filepath->clear();
+            paths->put(filepath);
+        }
+
+        /**
+         * Hands every input to dispatch as soon as it is read and returns
+         * how many were handed; walked gets the directories walked
+         */
+        template <typename Dispatch>
+        int stream(const string &imgdir, int walkers, object_pool<string> *paths, manifest *incremental, Dispatch dispatch, long &walked)
+        {
+            int listed = 0;
+            walked = 0;
+
+            if(walkers > 0)
+            {
+                tree_walker walk(imgdir, walkers, paths);
+                for(string *filepath = walk.next(); filepath != NULL; filepath = walk.next())
+                {
+                    if(incremental != NULL && !incremental->changed(*filepath))
+                    {
+                        drop(filepath, paths);
+                        continue;
+                    }
+                    listed++;
+                    dispatch(filepath);
+                }
+                walked = walk.directories();
+                return listed;
+            }
+
+            dir_stream dir(imgdir);
+            for(const char *name = dir.next(); name != NULL; name = dir.next())
+            {
+                // the outputs written meanwhile may show up in the listing
+                if(is_output_file(name) || dir.type() == DT_DIR) continue;
+
+                string *filepath = paths->get();
+                filepath->reserve(imgdir.size() + dir.length());
+                filepath->append(imgdir).append(name, dir.length());
+                if(incremental != NULL && !incremental->changed(*filepath))
+                {
+                    drop(filepath, paths);
+                    continue;
+                }
+
+                listed++;
+                dispatch(filepath);
+            }
+            return listed;
+        }
+
+        /**
+         * Appends every input to filenames once the whole directory is read;
+         * walked gets the directories walked
+         */
+        void batch(const string &imgdir, int walkers, object_pool<string> *paths, manifest *incremental, vector<string *> &filenames, long &walked)
+        {
+            walked = 0;
+            if(walkers > 0)
+            {
+                tree_walker walk(imgdir, walkers, paths);
+                walk.list(filenames);
+                walked = walk.directories();
+            }
+            else read_filenames(imgdir, filenames, paths);
+
+            if(incremental != NULL) incremental->filter(filenames, paths);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef IWM_MANIFEST
+#define IWM_MANIFEST
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#include "hash.cpp"
+#include "pool.cpp"
+
+/**
+ * Name of the manifest in the image directory, an output itself so that
+ * it is never listed as an input
+ */
+#define MANIFEST_NAME OUT_SUFFIX "manifest"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Inputs already processed with a stamp, for incremental runs.
+     *
+     * The manifest file keeps the hash of the stamp and the modification
+     * time and size of every input whose output was written. An input is
+     * up to date when it did not change since and its output still exists;
+     * the whole manifest is void when the stamp changed. Only the inputs
+     * seen by the run are saved, so deleted files drop out of it.
+     */
+    class manifest
+    {
+    private:
+        struct entry_t
+        {
+            long long mtime;
+            long long size;
+
+            bool operator==(const entry_t &other) const
+            {
+                return mtime == other.mtime && size == other.size;
+            }
+        };
+
+        string _path;
+        uint64_t _stamp;
+
+        /**
+         * Loaded entries, entries of this run, inputs being processed
+         */
+        unordered_map<string, entry_t> _loaded;
+        unordered_map<string, entry_t> _current;
+        unordered_map<string, entry_t> _pending;
+        long _fresh = 0;
+
+        mutex _mutex;
+
+        static bool stat_entry(const string &path, entry_t &entry)
+        {
+            struct stat info;
+            if(stat(path.c_str(), &info) != 0) return false;
+            entry.mtime = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+            entry.size = info.st_size;
+            return true;
+        }
+
+        void load()
+        {
+            ifstream in(_path);
+            string magic;
+            uint64_t stamp;
+            if(!(in >> magic >> hex >> stamp >> dec) || magic != "iwm-manifest" || stamp != _stamp) return;
+
+            entry_t entry;
+            string input;
+            while(in >> entry.mtime >> entry.size && in.get() == ' ' && getline(in, input)) _loaded[input] = entry;
+        }
+
+    public:
+        /**
+         * Reads the manifest at path, void if it was written for another
+         * stamp
+         */
+        manifest(const string &path, uint64_t stamp) : _path(path), _stamp(stamp)
+        {
+            load();
+        }
+
+        /**
+         * True if the input has to be processed, false if its output is
+         * up to date
+         */
+        bool changed(const string &input)
+        {
+            entry_t entry;
+            if(!stat_entry(input, entry)) return true;
+
+            // the loaded entries are read only
+            struct stat output;
+            auto loaded = _loaded.find(input);
+            const bool fresh = loaded != _loaded.end() && loaded->second == entry && stat(get_new_filename(input).c_str(), &output) == 0;
+
+            lock_guard<mutex> lock(_mutex);
+            if(fresh)
+            {
+                _current[input] = entry;
+                _fresh++;
+            }
+            else
+            {
+                _pending[input] = entry;
+            }
+            return !fresh;
+        }
+
+        /**
+         * Removes the inputs that are up to date, giving their paths back to
+         * the pool they were taken from if any, freeing them otherwise
+         */
+        void filter(vector<string *> &filenames, object_pool<string> *paths = NULL)
+        {
+            size_t kept = 0;
+            for(string *filepath : filenames)
+            {
+                if(changed(*filepath)) filenames[kept++] = filepath;
+                else if(paths != NULL)
+                {
+                    filepath->clear();
+                    paths->put(filepath);
+                }
+                else delete filepath;
+            }
+            filenames.resize(kept);
+        }
+
+        /**
+         * The output of the input was written
+         */
+        void done(const string &input)
+        {
+            lock_guard<mutex> lock(_mutex);
+            auto pending = _pending.find(input);
+            if(pending == _pending.end()) return;
+            _current[input] = pending->second;
+            _pending.erase(pending);
+        }
+
+        /**
+         * Writes the manifest of this run, false on error
+         */
+        bool save()
+        {
+            lock_guard<mutex> lock(_mutex);
+            const string temp = _path + ".tmp";
+            {
+                ofstream out(temp, ios::trunc);
+                out << "iwm-manifest " << hex << _stamp << dec << "\n";
+                for(auto &entry : _current) out << entry.second.mtime << " " << entry.second.size << " " << entry.first << "\n";
+                if(!out.flush()) return false;
+            }
+            // a crash leaves the previous manifest in place
+            return rename(temp.c_str(), _path.c_str()) == 0;
+        }
+
+        /**
+         * Inputs skipped as up to date
+         */
+        long fresh()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _fresh;
+        }
+
+        /**
+         * Inputs of this run recorded so far
+         */
+        long recorded()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _current.size();
+        }
+    };
+}
+
+#endif
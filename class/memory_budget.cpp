@@ -0,0 +1,209 @@
+#ifndef IWM_MEMORY_BUDGET
+#define IWM_MEMORY_BUDGET
+
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include <sys/stat.h>
+
+#include "../lib/CImg/CImg.h"
+#include "codec.cpp"
+#include "huge_arena.cpp"
+#include "pool.cpp"
+
+/**
+ * Decoded bytes per file byte assumed when the header of an image cannot
+ * be read: an uncompressed or losslessly compressed file rarely decodes to
+ * more than this
+ */
+#ifndef BUDGET_EXPANSION
+#define BUDGET_EXPANSION 4
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Admission control of the decoded images.
+     *
+     * A loader reserves the bytes of an image (width x height x spectrum)
+     * before decoding it and blocks while the images in flight already use
+     * the whole budget; the collector gives the bytes back when the job is
+     * done. An image is always admitted when nothing else is in flight, so
+     * a single image larger than the budget cannot deadlock the farm.
+     * A zero limit only keeps the accounting. With an image pool the heap
+     * images are decoded into recycled buffers.
+     */
+    class memory_budget
+    {
+    private:
+        size_t _limit;
+        size_t _used = 0;
+        size_t _peak = 0;
+        long _waits = 0;
+
+        image_pool *_images;
+
+        mutex _mutex;
+        condition_variable _released;
+
+        bool fits(size_t bytes)
+        {
+            return _limit == 0 || _used == 0 || _used + bytes <= _limit;
+        }
+
+        void charge(size_t bytes)
+        {
+            _used += bytes;
+            _peak = max(_peak, _used);
+        }
+
+        /**
+         * Decodes a heap image, into a recycled buffer of the size announced
+         * by its header when there is a pool
+         */
+        cimg_library::CImg<CIMG_TYPE> *decode(const string &path)
+        {
+            if(_images == NULL) return codec::load(path);
+
+            int width, height, spectrum;
+            const size_t values = codec::dimensions(path, width, height, spectrum) ? (size_t)width * height * spectrum : 0;
+            cimg_library::CImg<CIMG_TYPE> *image = _images->get(values);
+            try
+            {
+                codec::load(path, *image);
+            }
+            catch(...)
+            {
+                _images->put(image);
+                throw;
+            }
+            return image;
+        }
+
+    public:
+        memory_budget(size_t limit, image_pool *images = NULL) : _limit(limit), _images(images)
+        {
+        }
+
+        /**
+         * Bytes of the decoded image, from its JPEG header, or BUDGET_EXPANSION
+         * times the file size for the other formats (TIFF, cimgio builds).
+         * Never 0, so that every image goes through the admission; the
+         * reservation is corrected once the image is decoded.
+         */
+        static size_t estimate(const string &path)
+        {
+            int width, height, spectrum;
+            if(codec::dimensions(path, width, height, spectrum)) return (size_t)width * height * spectrum * sizeof(CIMG_TYPE);
+
+            struct stat info;
+            if(stat(path.c_str(), &info) != 0 || info.st_size <= 0) return 1;
+            return (size_t)info.st_size * BUDGET_EXPANSION;
+        }
+
+        static size_t bytes(const cimg_library::CImg<CIMG_TYPE> &image)
+        {
+            return image.size() * sizeof(CIMG_TYPE);
+        }
+
+        /**
+         * Reserves the bytes, waiting for room
+         */
+        void acquire(size_t bytes)
+        {
+            unique_lock<mutex> lock(_mutex);
+            if(!fits(bytes))
+            {
+                _waits++;
+                _released.wait(lock, [&] { return fits(bytes); });
+            }
+            charge(bytes);
+        }
+
+        /**
+         * Reserves the bytes only if there is room now
+         */
+        bool try_acquire(size_t bytes)
+        {
+            unique_lock<mutex> lock(_mutex);
+            if(!fits(bytes)) return false;
+            charge(bytes);
+            return true;
+        }
+
+        void release(size_t bytes)
+        {
+            {
+                unique_lock<mutex> lock(_mutex);
+                _used -= min(bytes, _used);
+            }
+            _released.notify_all();
+        }
+
+        /**
+         * Decodes an image whose estimated bytes are already reserved and
+         * corrects the reservation to its actual bytes, returned in charged.
+         * With an arena the image is decoded in the huge pages of the worker.
+         */
+        cimg_library::CImg<CIMG_TYPE> *load(const string &path, size_t reserved, size_t &charged, huge_arena *arena = NULL, int worker = 0)
+        {
+            cimg_library::CImg<CIMG_TYPE> *image;
+            try
+            {
+                image = arena != NULL ? arena->load(path, worker) : decode(path);
+            }
+            catch(...)
+            {
+                release(reserved);
+                throw;
+            }
+
+            charged = bytes(*image);
+            if(charged > reserved)
+            {
+                unique_lock<mutex> lock(_mutex);
+                charge(charged - reserved);
+            }
+            else if(charged < reserved)
+            {
+                release(reserved - charged);
+            }
+            return image;
+        }
+
+        /**
+         * Reserves the estimated bytes of the image, then decodes it
+         */
+        cimg_library::CImg<CIMG_TYPE> *load(const string &path, size_t &charged, huge_arena *arena = NULL, int worker = 0)
+        {
+            const size_t reserved = estimate(path);
+            acquire(reserved);
+            return load(path, reserved, charged, arena, worker);
+        }
+
+        size_t limit() const
+        {
+            return _limit;
+        }
+
+        size_t peak()
+        {
+            unique_lock<mutex> lock(_mutex);
+            return _peak;
+        }
+
+        /**
+         * Number of loads that had to wait for room
+         */
+        long waits()
+        {
+            unique_lock<mutex> lock(_mutex);
+            return _waits;
+        }
+    };
+}
+
+#endif
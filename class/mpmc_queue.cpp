@@ -0,0 +1,171 @@
+#ifndef MPMC_QUEUE
+#define MPMC_QUEUE
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "wait_strategy.cpp"
+#include "aligned.cpp"
+
+/**
+ * Default number of cells of a queue (a power of two)
+ */
+#ifndef MPMC_CAPACITY
+#define MPMC_CAPACITY 1024
+#endif
+
+using namespace std;
+
+/**
+ * Lock-free bounded multi-producer/multi-consumer queue (Vyukov).
+ *
+ * Every cell carries a sequence number telling whether it is free for
+ * the producer of round pos or full for the consumer of round pos, so
+ * producers and consumers only contend on their own index with a CAS
+ * and never on a lock. Same push/pop interface as blocking_queue; push
+ * blocks while the queue is full.
+ */
+template <typename T>
+class mpmc_queue : public aligned_new<QUEUE_CACHE_LINE>
+{
+private:
+    struct alignas(QUEUE_CACHE_LINE) cell_t
+    {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    cell_t *_cells;
+    size_t _mask;
+
+    alignas(QUEUE_CACHE_LINE) atomic<size_t> _enqueue_pos;
+    alignas(QUEUE_CACHE_LINE) atomic<size_t> _dequeue_pos;
+
+    waiter _not_empty;
+    waiter _not_full;
+
+public:
+    mpmc_queue(size_t capacity = MPMC_CAPACITY, wait_strategy wait = wait_strategy::park) : _not_empty(wait), _not_full(wait)
+    {
+        size_t cells = 2;
+        while(cells < capacity) cells <<= 1;
+        _mask = cells - 1;
+
+        // operator new ignores the cell alignment before C++17
+        void *buffer = NULL;
+        if(posix_memalign(&buffer, QUEUE_CACHE_LINE, cells * sizeof(cell_t)) != 0) throw bad_alloc();
+        _cells = (cell_t *)buffer;
+        for(size_t i = 0; i < cells; i++)
+        {
+            new(&_cells[i]) cell_t();
+            _cells[i].sequence.store(i, memory_order_relaxed);
+        }
+
+        _enqueue_pos.store(0, memory_order_relaxed);
+        _dequeue_pos.store(0, memory_order_relaxed);
+    }
+
+    ~mpmc_queue()
+    {
+        for(size_t i = 0; i <= _mask; i++) _cells[i].~cell_t();
+        free(_cells);
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    /**
+     * Returns false if the queue is full
+     */
+    bool try_push(T const &value)
+    {
+        cell_t *cell;
+        size_t pos = _enqueue_pos.load(memory_order_relaxed);
+        for(;;)
+        {
+            cell = &_cells[pos & _mask];
+            const size_t sequence = cell->sequence.load(memory_order_acquire);
+            const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if(diff == 0)
+            {
+                if(_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+
+        cell->data = value;
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    /**
+     * Returns false if the queue is empty
+     */
+    bool try_pop(T &value)
+    {
+        cell_t *cell;
+        size_t pos = _dequeue_pos.load(memory_order_relaxed);
+        for(;;)
+        {
+            cell = &_cells[pos & _mask];
+            const size_t sequence = cell->sequence.load(memory_order_acquire);
+            const intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if(diff == 0)
+            {
+                if(_dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+
+        value = move(cell->data);
+        cell->sequence.store(pos + _mask + 1, memory_order_release);
+        return true;
+    }
+
+    void push(T const &value)
+    {
+        if(!try_push(value)) _not_full.wait([&] { return try_push(value); });
+        _not_empty.wake();
+    }
+
+    T pop()
+    {
+        T value;
+        if(!try_pop(value)) _not_empty.wait([&] { return try_pop(value); });
+        _not_full.wake();
+        return value;
+    }
+
+    /**
+     * Number of queued values, a hint only since other threads keep going
+     */
+    size_t size()
+    {
+        const size_t dequeued = _dequeue_pos.load(memory_order_acquire);
+        const size_t enqueued = _enqueue_pos.load(memory_order_acquire);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef IWM_OPTIONS
+#define IWM_OPTIONS
+
+#include <string>
+#include <map>
+#include <cstdlib>
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Optional "--name value" arguments following the positional ones
+     */
+    class options
+    {
+    private:
+        map<string, string> _values;
+
+    public:
+        options(int argc, char **argv, int first)
+        {
+            for(int i = first; i < argc; i++)
+            {
+                if(strncmp(argv[i], "--", 2) != 0) continue;
+
+                string name = argv[i] + 2;
+                if(i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+                {
+                    _values[name] = argv[++i];
+                }
+                else
+                {
+                    _values[name] = "";
+                }
+            }
+        }
+
+        bool has(const string &name)
+        {
+            return _values.count(name) > 0;
+        }
+
+        string get(const string &name, const string &def)
+        {
+            return has(name) ? _values[name] : def;
+        }
+
+        int getInt(const string &name, int def)
+        {
+            return has(name) ? atoi(_values[name].c_str()) : def;
+        }
+    };
+}
+
+#endif
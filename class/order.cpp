@@ -0,0 +1,100 @@
+#ifndef IWM_ORDER
+#define IWM_ORDER
+
+#include <string>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "codec.cpp"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Order in which the emitter dispatches the files.
+     *
+     * readdir keeps the directory order, size dispatches the largest files
+     * first and lpt the images with most pixels first (longest processing
+     * time first), which minimizes the makespan of a mixed batch.
+     */
+    namespace order
+    {
+        bool valid(const string &policy)
+        {
+            return policy == "readdir" || policy == "size" || policy == "lpt";
+        }
+
+        /**
+         * Size of the file in bytes, 0 if it cannot be stat'ed
+         */
+        double file_bytes(const string &path)
+        {
+            struct stat info;
+            return stat(path.c_str(), &info) == 0 ? (double)info.st_size : 0;
+        }
+
+        /**
+         * Reorders the files according to the policy and returns the
+         * estimated cost (pixels) of each of them, in the new order.
+         *
+         * The pixels come from the image header; files without a readable
+         * header are estimated from their size with the pixels/byte ratio
+         * of the others. readdir leaves the files untouched and returns no
+         * costs, so it costs no open per file before the first dispatch.
+         */
+        vector<double> sort(const string &policy, vector<string *> &filenames)
+        {
+            if(policy == "readdir") return vector<double>();
+
+            const size_t n = filenames.size();
+            vector<double> bytes(n), pixels(n, -1);
+
+            double known_pixels = 0, known_bytes = 0;
+            for(size_t i = 0; i < n; i++)
+            {
+                bytes[i] = file_bytes(*filenames[i]);
+
+                int width, height;
+                if(codec::dimensions(*filenames[i], width, height))
+                {
+                    pixels[i] = (double)width * height;
+                    known_pixels += pixels[i];
+                    known_bytes += bytes[i];
+                }
+            }
+
+            const double per_byte = known_bytes > 0 ? known_pixels / known_bytes : 1;
+            for(size_t i = 0; i < n; i++)
+            {
+                if(pixels[i] < 0) pixels[i] = bytes[i] * per_byte;
+            }
+
+            vector<size_t> index(n);
+            iota(index.begin(), index.end(), 0);
+            if(policy == "size")
+            {
+                stable_sort(index.begin(), index.end(), [&](size_t a, size_t b) { return bytes[a] > bytes[b]; });
+            }
+            else if(policy == "lpt")
+            {
+                stable_sort(index.begin(), index.end(), [&](size_t a, size_t b) { return pixels[a] > pixels[b]; });
+            }
+
+            vector<string *> sorted(n);
+            vector<double> costs(n);
+            for(size_t i = 0; i < n; i++)
+            {
+                sorted[i] = filenames[index[i]];
+                costs[i] = pixels[index[i]];
+            }
+            filenames.swap(sorted);
+
+            return costs;
+        }
+    }
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <chrono>
 #include <iomanip>
+#include <queue>
+#include <functional>
+#include <sys/resource.h>
 
 using namespace std;
 
@@ -24,6 +27,34 @@ struct perf_entry_t
     pair<time_entry, time_entry> latency_stage1;
     pair<time_entry, time_entry> latency_stage2;
     pair<time_entry, time_entry> latency_stage3;
+
+    /**
+     * Time spent in the stages (ms), without the queues
+     */
+    double work() const
+    {
+        return fsec((latency_stage1.second - latency_stage1.first) + (latency_stage2.second - latency_stage2.first) + (latency_stage3.second - latency_stage3.first)).count();
+    }
+};
+
+/**
+ * Objects a free list gave back (hits) and had to allocate (misses)
+ */
+struct pool_stats_t
+{
+    long hits;
+    long misses;
+};
+
+/**
+ * Time a farm worker spent processing jobs (busy) and waiting for them (idle)
+ */
+struct worker_stats_t
+{
+    double busy = 0;
+    double idle = 0;
+    long jobs = 0;
+    long steals = 0;
 };
 
 #include "job.cpp"
@@ -34,25 +65,85 @@ namespace iwm
     {
     private:
         int _processed = 0;
+        int _untouched = 0;
+        int _mapped = 0;
+        int _map_workers = 0;
 
         pair<time_entry, time_entry> _tc;
         pair<time_entry, time_entry> _setup;
         pair<time_entry, time_entry> _stamp;
+        long _stamp_spans = -1;
+        double _stamp_coverage = 0;
+        int _stamp_fits = 0;
+        int _stamp_box[4] = { 0, 0, 0, 0 };
 
         pair<time_entry, time_entry> _emitter_time;
+        int _walkers = 0;
+        long _walked = 0;
+
+        /**
+         * Dedup cache: -1 hits when it is off
+         */
+        long _dedup_hits = -1;
+        long _dedup_misses = 0;
+        double _dedup_saved = 0;
+        double _dedup_hashing = 0;
+        vector<worker_stats_t> _workers;
+
+        size_t _budget = 0;
+        size_t _budget_peak = 0;
+        long _budget_waits = 0;
+
+        /**
+         * Pools of the jobs, paths and images, and calls to operator new
+         * from the setup to the last collected job: -1 allocations when
+         * they are not counted
+         */
+        pool_stats_t _pools[3] = {};
+        long _allocations = -1;
+
+        /**
+         * Estimated cost (pixels) of the jobs, in dispatch order
+         */
+        vector<double> _costs;
+        int _schedule_workers = 0;
         vector<perf_entry_t> _entries;
         vector<time_entry> _ts;
 
-        double toMillis(fsec t)
+        static double toMillis(fsec t)
         {
             return t.count();
         }
+
+        /**
+         * Makespan of the greedy list schedule: each job, in order, goes to
+         * the least loaded worker
+         */
+        static double makespan(const vector<double> &times, int workers)
+        {
+            priority_queue<double, vector<double>, greater<double>> loads;
+            for(int i = 0; i < workers; i++) loads.push(0);
+
+            double result = 0;
+            for(double t : times)
+            {
+                double load = loads.top() + t;
+                loads.pop();
+                loads.push(load);
+                result = max(result, load);
+            }
+            return result;
+        }
     public:
 
-        void setProcessed(int p)
+        /**
+         * Number of files to process; the entries are not reserved when
+         * the count is only known once the jobs are already registered
+         */
+        void setProcessed(int p, bool reserve = true)
         {
             _processed = p;
-            _entries.reserve(p);
+            if(reserve) _entries.reserve(p);
         }
 
         void setStampTime(time_entry start, time_entry end)
@@ -61,6 +152,44 @@ namespace iwm
             _stamp.second = end;
         }
 
+        void setStampSpans(long spans, double coverage)
+        {
+            _stamp_spans = spans;
+            _stamp_coverage = coverage;
+        }
+
+        void setStampBox(int left, int top, int right, int bottom)
+        {
+            _stamp_box[0] = left;
+            _stamp_box[1] = top;
+            _stamp_box[2] = right;
+            _stamp_box[3] = bottom;
+        }
+
+        void setStampFits(int fits)
+        {
+            _stamp_fits = fits;
+        }
+
+        void setMapWorkers(int workers)
+        {
+            _map_workers = workers;
+        }
+
+        void setWalk(int walkers, long directories)
+        {
+            _walkers = walkers;
+            _walked = directories;
+        }
+
+        void setDedup(long hits, long misses, double saved, double hashing)
+        {
+            _dedup_hits = hits;
+            _dedup_misses = misses;
+            _dedup_saved = saved;
+            _dedup_hashing = hashing;
+        }
+
         void setSetupTime(time_entry start, time_entry end)
         {
             _setup.first = start;
@@ -79,10 +208,64 @@ namespace iwm
             _emitter_time.second = end;
         }
 
+        void setMemory(size_t budget, size_t peak, long waits)
+        {
+            _budget = budget;
+            _budget_peak = peak;
+            _budget_waits = waits;
+        }
+
+        void setPools(pool_stats_t jobs, pool_stats_t paths, pool_stats_t images, long allocations)
+        {
+            _pools[0] = jobs;
+            _pools[1] = paths;
+            _pools[2] = images;
+            _allocations = allocations;
+        }
+
+        void setSchedule(const vector<double> &costs, int workers)
+        {
+            _costs = costs;
+            _schedule_workers = workers;
+        }
+
+        void setWorkerStats(const vector<worker_stats_t> &workers)
+        {
+            _workers = workers;
+        }
+
         void registerJob(iwm::Job *job)
         {
             _ts.push_back(now());
             _entries.push_back(job->getPerfEntry());
+            if(!job->isStamped()) _untouched++;
+            if(job->isMapped()) _mapped++;
+        }
+
+        /**
+         * Average service time of each stage over the entries
+         */
+        static void stageLatencies(const vector<perf_entry_t> &entries, double &s1, double &s2, double &s3)
+        {
+            s1 = s2 = s3 = 0;
+            for(auto &pair : entries)
+            {
+                s1 = s1 + toMillis(pair.latency_stage1.second - pair.latency_stage1.first);
+                s2 = s2 + toMillis(pair.latency_stage2.second - pair.latency_stage2.first);
+                s3 = s3 + toMillis(pair.latency_stage3.second - pair.latency_stage3.first);
+            }
+            if(entries.empty()) return;
+            s1 = s1 / entries.size();
+            s2 = s2 / entries.size();
+            s3 = s3 / entries.size();
+        }
+
+        /**
+         * Average service time of each stage over the jobs registered so far
+         */
+        void stageLatencies(double &s1, double &s2, double &s3)
+        {
+            stageLatencies(_entries, s1, s2, s3);
         }
 
         time_entry now()
@@ -94,9 +277,34 @@ namespace iwm
         {
             cout << "---Results---" << endl;
             cout << "Processed: " << _processed << endl;
+            cout << "Untouched: " << _untouched << endl;
+            cout << "Mapped: " << _mapped << " (" << _map_workers << " map workers)" << endl;
+            if(_walkers > 0) cout << "Walked: " << _walked << " directories (" << _walkers << " walkers)" << endl;
+            if(_dedup_hits >= 0)
+            {
+                cout << "Dedup: " << _dedup_hits << " hits, " << _dedup_misses << " misses, saved " << _dedup_saved << " (hashing " << _dedup_hashing << ")" << endl;
+            }
 
             fsec stamp_diff = _stamp.second - _stamp.first;
             cout << "Stamp loading: " << toMillis(stamp_diff) << endl;
+            if(_stamp_spans >= 0)
+            {
+                cout << "Stamp spans: " << _stamp_spans << " (coverage " << _stamp_coverage * 100 << "%)" << endl;
+            }
+            cout << "Stamp box: [" << _stamp_box[0] << ", " << _stamp_box[2] << ") x [" << _stamp_box[1] << ", " << _stamp_box[3] << ")" << endl;
+            cout << "Stamp fits: " << _stamp_fits << endl;
+
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            cout << "Memory budget: " << (_budget >> 20) << "MB" << (_budget == 0 ? " (unlimited)" : "") << endl;
+            cout << "Decoded peak: " << (_budget_peak >> 20) << "MB, waits " << _budget_waits << endl;
+            cout << "Peak RSS: " << (usage.ru_maxrss >> 10) << "MB" << endl;
+            cout << "Page faults: " << usage.ru_minflt << " minor, " << usage.ru_majflt << " major" << endl;
+            if(_allocations >= 0)
+            {
+                cout << "Recycled (hits/misses): jobs " << _pools[0].hits << "/" << _pools[0].misses << ", paths " << _pools[1].hits << "/" << _pools[1].misses << ", images " << _pools[2].hits << "/" << _pools[2].misses << endl;
+                cout << "Allocations per image: " << (double)_allocations / max(_processed, 1) << endl;
+            }
 
             fsec setup_diff = _setup.second - _setup.first;
             cout << "Setup: " << toMillis(setup_diff) << endl;
@@ -106,13 +314,15 @@ namespace iwm
 
             double avg = 0;
             cout << "---Ts---" << endl;
-            for(vector<time_entry>::iterator it = _ts.begin(); it != _ts.end() - 1; it++)
+            // an incremental run may have nothing to process
+            for(size_t i = 1; i < _ts.size(); i++)
             {
-                fsec ts_diff = *(it + 1) - *it;
+                fsec ts_diff = _ts[i] - _ts[i - 1];
                 avg = avg + toMillis(ts_diff);
             }
+            const double jobs = max(_entries.size(), (size_t)1);
 
-            avg = avg / (_ts.size());
+            avg = avg / max(_ts.size(), (size_t)1);
             cout << "Ts avg: " << avg << endl;
 
             double lat_avg = 0;
@@ -121,12 +331,54 @@ namespace iwm
                 fsec lat_diff = pair.latency.second - pair.latency.first;
                 lat_avg = lat_avg + toMillis(lat_diff);
             }
-            lat_avg = lat_avg / _entries.size();
+            lat_avg = lat_avg / jobs;
             cout << "L avg: " << lat_avg << endl;
 
+            double s1_avg = 0, s2_avg = 0, s3_avg = 0;
+            for(auto &pair : _entries)
+            {
+                s1_avg = s1_avg + toMillis(pair.latency_stage1.second - pair.latency_stage1.first);
+                s2_avg = s2_avg + toMillis(pair.latency_stage2.second - pair.latency_stage2.first);
+                s3_avg = s3_avg + toMillis(pair.latency_stage3.second - pair.latency_stage3.first);
+            }
+            cout << "L S1 avg: " << s1_avg / jobs << endl;
+            cout << "L S2 avg: " << s2_avg / jobs << endl;
+            cout << "L S3 avg: " << s3_avg / jobs << endl;
+
             fsec emitter_diff = _emitter_time.second - _emitter_time.first;
             cout << "Emitter: " << toMillis(emitter_diff) << endl;
 
+            if(!_costs.empty() && !_entries.empty())
+            {
+                // ms per estimated pixel, from the summed stage latencies
+                double pixels = 0;
+                for(double c : _costs) pixels = pixels + c;
+                pixels = pixels * _entries.size() / _costs.size();
+                const double rate = pixels > 0 ? (s1_avg + s2_avg + s3_avg) / pixels : 0;
+
+                vector<double> times;
+                for(double c : _costs) times.push_back(c * rate);
+
+                cout << "Makespan predicted: " << makespan(times, _schedule_workers) << " (" << _schedule_workers << " workers)" << endl;
+                cout << "Makespan actual: " << toMillis(tc_diff) << endl;
+            }
+
+            if(!_workers.empty())
+            {
+                cout << "---Workers---" << endl;
+                double busy_max = 0, busy_avg = 0;
+                for(size_t i = 0; i < _workers.size(); i++)
+                {
+                    worker_stats_t &w = _workers[i];
+                    cout << "Worker " << i << ": busy " << w.busy << ", idle " << w.idle
+                         << ", jobs " << w.jobs << ", stolen " << w.steals << endl;
+                    busy_max = max(busy_max, w.busy);
+                    busy_avg = busy_avg + w.busy;
+                }
+                busy_avg = busy_avg / _workers.size();
+                cout << "Busy max/avg: " << (busy_avg > 0 ? busy_max / busy_avg : 0) << endl;
+            }
+
             cout << "Entries:" << endl;
             cout << std::setw(5) << "n" << std::setw(5) << "|"
                  << std::setw(5) << "L" << std::setw(5) << "|"
@@ -0,0 +1,171 @@
+#ifndef IWM_POOL
+#define IWM_POOL
+
+#include <map>
+#include <vector>
+#include <mutex>
+
+#include "../lib/CImg/CImg.h"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Free list of objects of type T: get() reuses a returned object when
+     * there is one, put() keeps at most capacity of them and deletes the
+     * others. The caller resets an object before giving it back.
+     */
+    template <typename T>
+    class object_pool
+    {
+    private:
+        vector<T *> _free;
+        size_t _capacity;
+        long _hits = 0;
+        long _misses = 0;
+
+        mutex _mutex;
+
+    public:
+        object_pool(size_t capacity) : _capacity(capacity)
+        {
+            _free.reserve(capacity);
+        }
+
+        ~object_pool()
+        {
+            for(T *object : _free) delete object;
+        }
+
+        T *get()
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                if(!_free.empty())
+                {
+                    T *object = _free.back();
+                    _free.pop_back();
+                    _hits++;
+                    return object;
+                }
+                _misses++;
+            }
+            return new T();
+        }
+
+        void put(T *object)
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                if(_free.size() < _capacity)
+                {
+                    _free.push_back(object);
+                    return;
+                }
+            }
+            delete object;
+        }
+
+        long hits()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _hits;
+        }
+
+        long misses()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _misses;
+        }
+    };
+
+    /**
+     * Recycled pixel buffers, keyed by their size class.
+     *
+     * The size class is the exact number of values of the image (width x
+     * height x spectrum), since CImg::assign() only keeps the buffer of an
+     * image that is assigned the same size: a loader borrows an image of
+     * the class expected from the file header and decodes into it, the
+     * collector gives it back instead of freeing it. At most capacity
+     * images are kept, whatever their class; images sharing a buffer they
+     * do not own (huge_arena) are deleted.
+     */
+    class image_pool
+    {
+    private:
+        map<size_t, vector<cimg_library::CImg<CIMG_TYPE> *>> _free;
+        size_t _capacity;
+        size_t _cached = 0;
+        long _hits = 0;
+        long _misses = 0;
+
+        mutex _mutex;
+
+    public:
+        image_pool(size_t capacity) : _capacity(capacity)
+        {
+        }
+
+        ~image_pool()
+        {
+            for(auto &size_class : _free)
+            {
+                for(cimg_library::CImg<CIMG_TYPE> *image : size_class.second) delete image;
+            }
+        }
+
+        /**
+         * An image holding a buffer of the given number of values if one is
+         * free, an empty image otherwise
+         */
+        cimg_library::CImg<CIMG_TYPE> *get(size_t values)
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                auto size_class = _free.find(values);
+                if(size_class != _free.end() && !size_class->second.empty())
+                {
+                    cimg_library::CImg<CIMG_TYPE> *image = size_class->second.back();
+                    size_class->second.pop_back();
+                    _cached--;
+                    _hits++;
+                    return image;
+                }
+                _misses++;
+            }
+            return new cimg_library::CImg<CIMG_TYPE>();
+        }
+
+        void put(cimg_library::CImg<CIMG_TYPE> *image)
+        {
+            if(image == NULL) return;
+            {
+                lock_guard<mutex> lock(_mutex);
+                if(_cached < _capacity && !image->is_empty() && !image->is_shared())
+                {
+                    vector<cimg_library::CImg<CIMG_TYPE> *> &size_class = _free[image->size()];
+                    if(size_class.capacity() == 0) size_class.reserve(_capacity);
+                    size_class.push_back(image);
+                    _cached++;
+                    return;
+                }
+            }
+            delete image;
+        }
+
+        long hits()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _hits;
+        }
+
+        long misses()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _misses;
+        }
+    };
+}
+
+#endif
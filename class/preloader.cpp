@@ -0,0 +1,228 @@
+#ifndef IWM_PRELOADER
+#define IWM_PRELOADER
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include "job.cpp"
+#include "memory_budget.cpp"
+#include "pool.cpp"
+#include "../lib/CImg/CImg.h"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Sliding-window preload of the images.
+     *
+     * A small pool of loader threads decodes the files ahead of the
+     * emitter, in their dispatch order, while at most window decoded
+     * images are in flight (loaded and not yet collected). The files are
+     * added as they are listed, so loading starts with the first one; the
+     * emitter takes the jobs in order as soon as they are ready, so the
+     * dispatch starts with the first image and the decoded memory is
+     * O(window) instead of O(batch).
+     *
+     * Loaders reserve the memory budget in claim order, so a later image
+     * never holds the budget an earlier one is waiting for.
+     */
+    class preloader
+    {
+    private:
+        /**
+         * Files added so far, in dispatch order; no more come once closed
+         */
+        vector<string *> _filenames;
+        bool _closed = false;
+        memory_budget *_budget;
+        object_pool<Job> *_jobs;
+        size_t _window;
+
+        /**
+         * Loaded jobs by position, NULL for files that could not be decoded
+         */
+        vector<Job *> _slots;
+        vector<bool> _ready;
+
+        /**
+         * Next position to load, next position to dispatch, decoded images in flight
+         */
+        size_t _claimed = 0;
+        size_t _next = 0;
+        size_t _in_flight = 0;
+
+        /**
+         * Time the emitter waited for the listing or the loaders (ms)
+         */
+        double _stall = 0;
+
+        mutex _mutex;
+        mutex _claim;
+        condition_variable _room;
+        condition_variable _loaded;
+
+        vector<thread *> _loaders;
+
+        /**
+         * Every file added is claimed and no more will come, under _mutex
+         */
+        bool finished() const
+        {
+            return _closed && _claimed == _filenames.size();
+        }
+
+        void load()
+        {
+            for(;;)
+            {
+                size_t i, reserved;
+                string *filename;
+                {
+                    lock_guard<mutex> claim(_claim);
+                    {
+                        unique_lock<mutex> lock(_mutex);
+                        _room.wait(lock, [&] { return finished() || (_claimed < _filenames.size() && _in_flight < _window); });
+                        if(finished()) return;
+                        i = _claimed++;
+                        _in_flight++;
+                        // the vector grows as the files are added
+                        filename = _filenames[i];
+                        // the other loaders are done too
+                        if(finished()) _room.notify_all();
+                    }
+                    reserved = memory_budget::estimate(*filename);
+                    _budget->acquire(reserved);
+                }
+
+                Job *job = NULL;
+                try
+                {
+                    size_t charged;
+                    cimg_library::CImg<CIMG_TYPE> *image = _budget->load(*filename, reserved, charged);
+
+                    job = _jobs != NULL ? _jobs->get() : new Job();
+                    job->setFilename(filename);
+                    job->setImage(image);
+                    job->setCharged(charged);
+                }
+                catch(cimg_library::CImgIOException &ex)
+                {
+#ifdef VERBOSE
+                    cerr << "Cannot load " << *filename << endl;
+#endif
+                    delete filename;
+                }
+
+                {
+                    lock_guard<mutex> lock(_mutex);
+                    _slots[i] = job;
+                    _ready[i] = true;
+                    if(job == NULL) _in_flight--;
+                }
+                _loaded.notify_one();
+                if(job == NULL) _room.notify_one();
+            }
+        }
+
+    public:
+        /**
+         * Starts the loaders, which wait for the files added and take their
+         * jobs from the pool given, if any
+         */
+        preloader(int window, int loaders, memory_budget *budget, object_pool<Job> *jobs = NULL)
+            : _budget(budget), _jobs(jobs), _window(window)
+        {
+            for(int i = 0; i < loaders; i++) _loaders.push_back(new thread(&preloader::load, this));
+        }
+
+        ~preloader()
+        {
+            for(thread *loader : _loaders)
+            {
+                loader->join();
+                delete loader;
+            }
+            for(Job *job : _slots) delete job;
+        }
+
+        /**
+         * Takes the ownership of the filename and queues it after the ones
+         * added before
+         */
+        void add(string *filename)
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                _filenames.push_back(filename);
+                _slots.push_back(NULL);
+                _ready.push_back(false);
+            }
+            _room.notify_one();
+        }
+
+        /**
+         * No more files will be added
+         */
+        void close()
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                _closed = true;
+            }
+            _room.notify_all();
+            _loaded.notify_all();
+        }
+
+        /**
+         * Emitter only: next loaded job in dispatch order, waiting for its
+         * loader; skips the files that could not be decoded, NULL once the
+         * preloader is closed and every file taken
+         */
+        Job *next()
+        {
+            unique_lock<mutex> lock(_mutex);
+            for(;;)
+            {
+                const size_t i = _next;
+                auto available = [&] { return i < _slots.size() ? (bool)_ready[i] : _closed; };
+                if(!available())
+                {
+                    auto start = chrono::high_resolution_clock::now();
+                    _loaded.wait(lock, available);
+                    _stall += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+                }
+                if(i == _slots.size()) return NULL;
+
+                _next++;
+                Job *job = _slots[i];
+                _slots[i] = NULL;
+                if(job != NULL) return job;
+            }
+        }
+
+        /**
+         * Collector only: a job left the farm, its window slot is free
+         */
+        void done()
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                _in_flight--;
+            }
+            _room.notify_one();
+        }
+
+        double stall()
+        {
+            lock_guard<mutex> lock(_mutex);
+            return _stall;
+        }
+    };
+}
+
+#endif
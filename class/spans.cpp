@@ -0,0 +1,108 @@
+#ifndef IWM_SPANS
+#define IWM_SPANS
+
+#include <vector>
+
+#include "../lib/CImg/CImg.h"
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * A run of consecutive black pixels in a stamp row
+     */
+    struct span_t
+    {
+        int start;
+        int length;
+    };
+
+    /**
+     * Run-length index of the black pixels of a stamp, built once when the
+     * stamp is loaded so the kernels only touch stamped pixels.
+     */
+    class span_index
+    {
+    private:
+        int _width;
+        int _height;
+        long _black = 0;
+
+        /**
+         * Spans of all rows, row y owns [_offsets[y], _offsets[y + 1])
+         */
+        vector<span_t> _spans;
+        vector<int> _offsets;
+
+    public:
+        span_index(const cimg_library::CImg<CIMG_TYPE> &stamp)
+        {
+            _width = stamp.width();
+            _height = stamp.height();
+            _offsets.reserve(_height + 1);
+
+            for(int y = 0; y < _height; y++)
+            {
+                _offsets.push_back(_spans.size());
+
+                const CIMG_TYPE *s = stamp.data(0, y);
+                int x = 0;
+                while(x < _width)
+                {
+                    if(s[x] != 0)
+                    {
+                        x++;
+                        continue;
+                    }
+
+                    int start = x;
+                    while(x < _width && s[x] == 0) x++;
+
+                    _spans.push_back({ start, x - start });
+                    _black += x - start;
+                }
+            }
+            _offsets.push_back(_spans.size());
+        }
+
+        int width() const
+        {
+            return _width;
+        }
+
+        int height() const
+        {
+            return _height;
+        }
+
+        const span_t *row_begin(int y) const
+        {
+            return _spans.data() + _offsets[y];
+        }
+
+        const span_t *row_end(int y) const
+        {
+            return _spans.data() + _offsets[y + 1];
+        }
+
+        /**
+         * Total number of spans
+         */
+        long count() const
+        {
+            return _spans.size();
+        }
+
+        /**
+         * Fraction of the stamp covered by black pixels
+         */
+        double coverage() const
+        {
+            long area = (long)_width * _height;
+            return area > 0 ? (double)_black / area : 0;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SPSC_QUEUE
+#define SPSC_QUEUE
+
+#include <atomic>
+
+#include "wait_strategy.cpp"
+#include "aligned.cpp"
+
+/**
+ * Default number of slots of a ring (a power of two)
+ */
+#ifndef SPSC_CAPACITY
+#define SPSC_CAPACITY 1024
+#endif
+
+using namespace std;
+
+/**
+ * Lock-free bounded single-producer/single-consumer ring.
+ *
+ * Same push/pop interface as blocking_queue, for links with exactly one
+ * thread on each side. The head and the tail live on their own cache
+ * lines, each next to the copy of the opposite index its owner last
+ * read, so the two threads only share a line when the ring looks empty
+ * or full. push blocks while the ring is full.
+ */
+template <typename T>
+class spsc_queue : public aligned_new<QUEUE_CACHE_LINE>
+{
+private:
+    // consumer side
+    alignas(QUEUE_CACHE_LINE) atomic<size_t> _head;
+    size_t _tail_cache = 0;
+
+    // producer side
+    alignas(QUEUE_CACHE_LINE) atomic<size_t> _tail;
+    size_t _head_cache = 0;
+
+    alignas(QUEUE_CACHE_LINE) T *_slots;
+    size_t _capacity;
+    size_t _mask;
+
+    waiter _not_empty;
+    waiter _not_full;
+
+public:
+    spsc_queue(size_t capacity = SPSC_CAPACITY, wait_strategy wait = wait_strategy::park) : _not_empty(wait), _not_full(wait)
+    {
+        _capacity = 1;
+        while(_capacity < capacity) _capacity <<= 1;
+        _mask = _capacity - 1;
+        _slots = new T[_capacity];
+
+        _head.store(0);
+        _tail.store(0);
+    }
+
+    ~spsc_queue()
+    {
+        delete[] _slots;
+    }
+
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    /**
+     * Producer only
+     */
+    void push(T const &value)
+    {
+        const size_t tail = _tail.load(memory_order_relaxed);
+        if(tail - _head_cache == _capacity)
+        {
+            _not_full.wait([&] { return tail - (_head_cache = _head.load(memory_order_acquire)) < _capacity; });
+        }
+
+        _slots[tail & _mask] = value;
+        _tail.store(tail + 1, memory_order_release);
+
+        _not_empty.wake();
+    }
+
+    /**
+     * Consumer only
+     */
+    T pop()
+    {
+        const size_t head = _head.load(memory_order_relaxed);
+        if(head == _tail_cache)
+        {
+            _not_empty.wait([&] { return head != (_tail_cache = _tail.load(memory_order_acquire)); });
+        }
+
+        T result(move(_slots[head & _mask]));
+        _head.store(head + 1, memory_order_release);
+
+        _not_full.wake();
+        return result;
+    }
+
+    /**
+     * Number of queued values, a hint only since the other side keeps going
+     */
+    size_t size()
+    {
+        return _tail.load(memory_order_acquire) - _head.load(memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+};
+
+#endif
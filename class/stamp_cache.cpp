@@ -0,0 +1,239 @@
+#ifndef IWM_STAMP_CACHE
+#define IWM_STAMP_CACHE
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+#include "../lib/CImg/CImg.h"
+#include "spans.cpp"
+#include "bitmask.cpp"
+
+/**
+ * Buckets of the fitted stamps, a power of two
+ */
+#ifndef STAMP_BUCKETS
+#define STAMP_BUCKETS 64
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * The stamp fitted to one image resolution, in the representation chosen
+     * with --mask: spans and bits are NULL for the plain byte mask.
+     */
+    struct fitted_stamp_t
+    {
+        cimg_library::CImg<CIMG_TYPE> mask;
+        span_index *spans = NULL;
+        stamp_bits *bits = NULL;
+
+        /**
+         * Tight bounding box of the black pixels, [left, right) x [top, bottom)
+         */
+        int left = 0;
+        int top = 0;
+        int right = 0;
+        int bottom = 0;
+
+        bool empty() const
+        {
+            return left >= right || top >= bottom;
+        }
+
+        ~fitted_stamp_t()
+        {
+            delete spans;
+            delete bits;
+        }
+    };
+
+    /**
+     * Cache of the stamp fitted to the image resolutions seen so far.
+     *
+     * The first image of a given (width, height) resizes the stamp mask
+     * (nearest neighbour, channel 0 only), bounds its black pixels and
+     * compiles it; every other worker then shares the entry read-only.
+     * The entries are published in lists of atomic pointers that are only
+     * ever prepended to, so a lookup takes no lock. A new entry is built
+     * outside the lock, which only serializes the publication: when two
+     * workers fit the same resolution at once, the second one drops its
+     * copy.
+     */
+    class stamp_cache
+    {
+    private:
+        struct entry_t
+        {
+            int width;
+            int height;
+            fitted_stamp_t *fitted;
+            entry_t *next;
+        };
+
+        const cimg_library::CImg<CIMG_TYPE> &_stamp;
+        string _mode;
+
+        mutex _mutex;
+        atomic<entry_t *> _buckets[STAMP_BUCKETS];
+        atomic<int> _size;
+
+        /**
+         * Caches compiled by compile(), looked up by the kernels
+         */
+        static map<const cimg_library::CImg<CIMG_TYPE> *, stamp_cache *> &registry()
+        {
+            static map<const cimg_library::CImg<CIMG_TYPE> *, stamp_cache *> caches;
+            return caches;
+        }
+
+        /**
+         * Computes the bounding box of the black pixels of the fitted mask
+         */
+        static void bound(fitted_stamp_t &fitted)
+        {
+            const cimg_library::CImg<CIMG_TYPE> &mask = fitted.mask;
+            int left = mask.width(), top = mask.height(), right = 0, bottom = 0;
+
+            for(int y = 0; y < mask.height(); y++)
+            {
+                const CIMG_TYPE *s = mask.data(0, y);
+                int first = 0;
+                while(first < mask.width() && s[first] != 0) first++;
+                if(first == mask.width()) continue;
+
+                int last = mask.width() - 1;
+                while(s[last] != 0) last--;
+
+                left = min(left, first);
+                right = max(right, last + 1);
+                top = min(top, y);
+                bottom = y + 1;
+            }
+
+            // no black pixel: empty box
+            if(bottom == 0) left = top = right = 0;
+
+            fitted.left = left;
+            fitted.top = top;
+            fitted.right = right;
+            fitted.bottom = bottom;
+        }
+
+        static size_t bucket(int width, int height)
+        {
+            return ((size_t)width * 31 + height) & (STAMP_BUCKETS - 1);
+        }
+
+        /**
+         * The published entry of the resolution, or NULL, from the head of
+         * its bucket
+         */
+        static fitted_stamp_t *search(entry_t *entry, int width, int height)
+        {
+            for(; entry != NULL; entry = entry->next)
+            {
+                if(entry->width == width && entry->height == height) return entry->fitted;
+            }
+            return NULL;
+        }
+
+        fitted_stamp_t *build(int width, int height) const
+        {
+            fitted_stamp_t *fitted = new fitted_stamp_t();
+            fitted->mask = _stamp.get_channel(0);
+            if(width != _stamp.width() || height != _stamp.height())
+            {
+                fitted->mask.resize(width, height, 1, 1, 1);
+            }
+
+            bound(*fitted);
+
+            if(_mode == "spans") fitted->spans = new span_index(fitted->mask);
+            if(_mode == "bits") fitted->bits = new stamp_bits(fitted->mask);
+            return fitted;
+        }
+
+    public:
+        stamp_cache(const cimg_library::CImg<CIMG_TYPE> &stamp, const string &mode) : _stamp(stamp), _mode(mode), _size(0)
+        {
+            for(int i = 0; i < STAMP_BUCKETS; i++) _buckets[i].store(NULL, memory_order_relaxed);
+        }
+
+        ~stamp_cache()
+        {
+            for(int i = 0; i < STAMP_BUCKETS; i++)
+            {
+                entry_t *entry = _buckets[i].load(memory_order_relaxed);
+                while(entry != NULL)
+                {
+                    entry_t *next = entry->next;
+                    delete entry->fitted;
+                    delete entry;
+                    entry = next;
+                }
+            }
+        }
+
+        /**
+         * Returns the stamp fitted to the resolution, building it on first sight
+         */
+        fitted_stamp_t &fit(int width, int height)
+        {
+            atomic<entry_t *> &head = _buckets[bucket(width, height)];
+            fitted_stamp_t *fitted = search(head.load(memory_order_acquire), width, height);
+            if(fitted != NULL) return *fitted;
+
+            fitted = build(width, height);
+
+            lock_guard<mutex> lock(_mutex);
+            entry_t *first = head.load(memory_order_relaxed);
+            fitted_stamp_t *published = search(first, width, height);
+            if(published != NULL)
+            {
+                delete fitted;
+                return *published;
+            }
+
+            head.store(new entry_t { width, height, fitted, first }, memory_order_release);
+            _size++;
+            return *fitted;
+        }
+
+        /**
+         * Number of resolutions fitted so far
+         */
+        int size()
+        {
+            return _size.load();
+        }
+
+        /**
+         * Builds the cache of the stamp and fits it to its own resolution.
+         * Must be called before the workers start.
+         */
+        static stamp_cache *compile(const cimg_library::CImg<CIMG_TYPE> &stamp, const string &mode)
+        {
+            stamp_cache *&cache = registry()[&stamp];
+            delete cache;
+            cache = new stamp_cache(stamp, mode);
+            cache->fit(stamp.width(), stamp.height());
+            return cache;
+        }
+
+        /**
+         * Returns the cache compiled for the stamp, or NULL
+         */
+        static stamp_cache *find(const cimg_library::CImg<CIMG_TYPE> &stamp)
+        {
+            map<const cimg_library::CImg<CIMG_TYPE> *, stamp_cache *> &caches = registry();
+            auto it = caches.find(&stamp);
+            return it != caches.end() ? it->second : NULL;
+        }
+    };
+}
+
+#endif
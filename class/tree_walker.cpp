@@ -0,0 +1,200 @@
+#ifndef IWM_TREE_WALKER
+#define IWM_TREE_WALKER
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "blocking_queue.cpp"
+#include "dir_stream.cpp"
+#include "pool.cpp"
+
+/**
+ * Bytes of directory entries read at once by a walker
+ */
+#ifndef WALK_BUFFER
+#define WALK_BUFFER (64UL << 10)
+#endif
+
+/**
+ * Files found and not yet taken by the emitter
+ */
+#ifndef WALK_QUEUE
+#define WALK_QUEUE 4096
+#endif
+
+using namespace std;
+
+namespace iwm
+{
+    /**
+     * Parallel recursive enumeration of the image files of a tree.
+     *
+     * A walker reads a directory with a dir_stream and opens its
+     * subdirectories with openat on the directory descriptor; an entry
+     * of unknown type is classified with fstatat. A subdirectory goes to
+     * an idle walker when there is one and is walked in place otherwise,
+     * so at most one descriptor per level and walker is open. Symbolic
+     * links to directories are not followed, outputs (out_*) are skipped.
+     *
+     * The paths of the files (strings of the pool given, if any) are
+     * queued as they are found, in no particular order, and next()
+     * returns NULL once the whole tree is walked.
+     */
+    class tree_walker
+    {
+    private:
+        struct dir_t
+        {
+            int fd;
+            string path;
+        };
+
+        vector<dir_t> _dirs;
+        int _idle = 0;
+        bool _finished = false;
+        mutex _mutex;
+        condition_variable _work;
+
+        blocking_queue<string *> _files;
+        object_pool<string> *_paths;
+        vector<thread *> _walkers;
+        atomic<long> _directories;
+
+        /**
+         * Hands the directory to an idle walker, false to walk it in place
+         */
+        bool share(int fd, const string &path)
+        {
+            {
+                lock_guard<mutex> lock(_mutex);
+                if((int)_dirs.size() >= _idle) return false;
+                _dirs.push_back({ fd, path });
+            }
+            _work.notify_one();
+            return true;
+        }
+
+        void walk(int fd, const string &path)
+        {
+            _directories++;
+            dir_stream dir(fd, WALK_BUFFER);
+            for(const char *name = dir.next(); name != NULL; name = dir.next())
+            {
+                if(is_output_file(name)) continue;
+
+                unsigned char type = dir.type();
+                if(type == DT_UNKNOWN || type == DT_LNK)
+                {
+                    struct stat info;
+                    if(fstatat(fd, name, &info, 0) != 0) continue;
+                    if(S_ISREG(info.st_mode)) type = DT_REG;
+                    else if(S_ISDIR(info.st_mode) && type == DT_UNKNOWN) type = DT_DIR;
+                    else continue;
+                }
+
+                if(type == DT_DIR)
+                {
+                    int child = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if(child < 0) continue;
+
+                    string child_path;
+                    child_path.reserve(path.size() + dir.length() + 1);
+                    child_path.append(path).append(name, dir.length()).append(1, '/');
+                    if(!share(child, child_path)) walk(child, child_path);
+                }
+                else if(type == DT_REG)
+                {
+                    string *filepath = _paths != NULL ? _paths->get() : new string();
+                    filepath->reserve(path.size() + dir.length());
+                    filepath->append(path).append(name, dir.length());
+                    _files.push(filepath);
+                }
+            }
+        }
+
+        void run()
+        {
+            unique_lock<mutex> lock(_mutex);
+            while(true)
+            {
+                _idle++;
+                if(_idle == (int)_walkers.size() && _dirs.empty())
+                {
+                    // the last busy walker is done: the tree is walked
+                    _finished = true;
+                    _files.push(NULL);
+                    _work.notify_all();
+                }
+                _work.wait(lock, [&] { return !_dirs.empty() || _finished; });
+                if(_finished) break;
+
+                _idle--;
+                dir_t dir = _dirs.back();
+                _dirs.pop_back();
+
+                lock.unlock();
+                walk(dir.fd, dir.path);
+                lock.lock();
+            }
+        }
+
+    public:
+        /**
+         * Starts walking the tree rooted in the directory (ending with /)
+         */
+        tree_walker(const string &root, int walkers, object_pool<string> *paths = NULL) : _files(WALK_QUEUE), _paths(paths), _directories(0)
+        {
+            int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(fd < 0) throw runtime_error("read_error");
+            _dirs.push_back({ fd, root });
+
+            // the walkers wait for the mutex until all of them are counted
+            lock_guard<mutex> lock(_mutex);
+            for(int i = 0; i < max(walkers, 1); i++) _walkers.push_back(new thread(&tree_walker::run, this));
+        }
+
+        ~tree_walker()
+        {
+            for(thread *walker : _walkers)
+            {
+                walker->join();
+                delete walker;
+            }
+        }
+
+        /**
+         * Path of the next file found, NULL once the tree is walked (and
+         * it must not be called again)
+         */
+        string *next()
+        {
+            return _files.pop();
+        }
+
+        /**
+         * Appends the paths of all the files of the tree
+         */
+        void list(vector<string *> &filenames)
+        {
+            for(string *filepath = next(); filepath != NULL; filepath = next()) filenames.push_back(filepath);
+        }
+
+        /**
+         * Directories walked so far
+         */
+        long directories() const
+        {
+            return _directories.load();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef WAIT_STRATEGY
+#define WAIT_STRATEGY
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Busy polls, then yields, before a park waiter blocks on the condition variable
+ */
+#ifndef WAIT_SPINS
+#define WAIT_SPINS 256
+#endif
+
+#ifndef WAIT_YIELDS
+#define WAIT_YIELDS 16
+#endif
+
+/**
+ * Alignment of the indices of the lock-free queues
+ */
+#define QUEUE_CACHE_LINE 64
+
+using namespace std;
+
+/**
+ * How a thread waits on an empty or full lock-free queue
+ */
+enum class wait_strategy
+{
+    spin,   // busy poll, lowest latency, burns the core
+    yield,  // poll and yield the core to other threads
+    park    // poll and yield a little, then sleep until the other side signals
+};
+
+/**
+ * Parses "spin", "yield" or "park", returns false for anything else
+ */
+inline bool parse_wait_strategy(const string &name, wait_strategy &strategy)
+{
+    if(name == "spin") strategy = wait_strategy::spin;
+    else if(name == "yield") strategy = wait_strategy::yield;
+    else if(name == "park") strategy = wait_strategy::park;
+    else return false;
+    return true;
+}
+
+/**
+ * One condition of a lock-free queue ("not empty", "not full") that
+ * threads wait on according to a wait_strategy.
+ *
+ * With park, the side that makes the condition true only takes the mutex
+ * when somebody is actually parked.
+ */
+class waiter
+{
+private:
+    wait_strategy _wait;
+    int _spins;
+
+    atomic<int> _parked;
+    mutex _mutex;
+    condition_variable _condition;
+
+    static void relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+public:
+    waiter(wait_strategy wait) : _wait(wait)
+    {
+        // polling only pays off if the other side runs on another core
+        _spins = thread::hardware_concurrency() > 1 ? WAIT_SPINS : 0;
+        _parked.store(0);
+    }
+
+    /**
+     * Waits until ready() holds. ready() may have side effects (a try_pop),
+     * it is called until it succeeds once.
+     */
+    template <typename Ready>
+    void wait(Ready ready)
+    {
+        for(int i = 0; !ready(); i++)
+        {
+            if(_wait == wait_strategy::spin || i < _spins)
+            {
+                relax();
+            }
+            else if(_wait == wait_strategy::yield || i < _spins + WAIT_YIELDS)
+            {
+                this_thread::yield();
+            }
+            else
+            {
+                unique_lock<mutex> lock(_mutex);
+                _parked.fetch_add(1, memory_order_relaxed);
+                // pairs with the fence in wake(): either we see the update or it sees us parked
+                atomic_thread_fence(memory_order_seq_cst);
+                _condition.wait(lock, ready);
+                _parked.fetch_sub(1, memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Signals a parked thread, after the condition became true for one more
+     * waiter (one value pushed or popped)
+     */
+    void wake()
+    {
+        if(_wait != wait_strategy::park) return;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if(_parked.load(memory_order_relaxed) > 0)
+        {
+            lock_guard<mutex> lock(_mutex);
+            _condition.notify_one();
+        }
+    }
+};
+
+#endif
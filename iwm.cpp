@@ -1,14 +1,27 @@
 #ifndef IWM_LIB
 #define IWM_LIB
 
+/**
+ * Pixel type of the pipeline: IWM_PIXEL16 builds a 16-bit pipeline
+ */
+#ifndef CIMG_TYPE
+#ifdef IWM_PIXEL16
+#define CIMG_TYPE unsigned short
+#else
 #define CIMG_TYPE unsigned char
+#endif
+#endif
+
 #define OUT_SUFFIX "out_"
 
 #ifndef TIME_UNIT_T
 #define TIME_UNIT_T "ms"
 #endif
 
+#include <cstdint>
+
 #include "lib/CImg/CImg.h"
+#include "class/pool.cpp"
 
 using namespace std;
 
@@ -38,25 +51,78 @@ namespace iwm
     }
 
     /**
-     * Returns the gray scale of the specified color
+     * Reference definition of the gray scale of the specified color
      */
-    int gray_scale(int r, int g, int b)
+    int gray_scale_reference(int r, int g, int b)
     {
         return (((r + g + b) / 3) + 255) / 2;
     }
 
     /**
-     * Check if the file is valid to be processed
+     * Returns the gray scale of a channel sum (0..765) without divisions:
+     * ((s / 3) + 255) / 2 == (s + 765) / 6 == ((s + 765) * 10923) >> 16
+     * for every sum of three 8-bit channels.
+     */
+    inline int gray_sum(int sum)
+    {
+        return ((sum + 765) * 10923) >> 16;
+    }
+
+    /**
+     * Returns the gray scale of the specified color
+     */
+    inline int gray_scale(int r, int g, int b)
+    {
+        return gray_sum(r + g + b);
+    }
+
+    /**
+     * Value of a white channel for the pixel type
+     */
+    template <typename T>
+    struct pixel_traits
+    {
+        static const int white = (1 << (8 * sizeof(T))) - 1;
+    };
+
+    /**
+     * Gray scale of a channel sum for any pixel type:
+     * ((s / 3) + white) / 2 == (s + 3 * white) / 6
+     */
+    template <typename T>
+    inline T gray_sum_t(int sum)
+    {
+        return (T)(((uint64_t)(sum + 3 * pixel_traits<T>::white) * 715827883u) >> 32);
+    }
+
+    template <>
+    inline unsigned char gray_sum_t<unsigned char>(int sum)
+    {
+        return gray_sum(sum);
+    }
+
+    /**
+     * Check if the file name is the one of an output
+     */
+    bool is_output_file(const char *name)
+    {
+        return strncmp(name, OUT_SUFFIX, sizeof(OUT_SUFFIX) - 1) == 0;
+    }
+
+    /**
+     * Check if the file is valid to be processed: outputs of a previous
+     * run are not
      */
     bool is_valid_file(char *path)
     {
-        return strcmp(path, ".") != 0 && strcmp(path, "..") != 0;
+        return strcmp(path, ".") != 0 && strcmp(path, "..") != 0 && !is_output_file(path);
     }
 
     /**
-     * Reads the file names in a directory and put them in the vector.
+     * Reads the file names in a directory and put them in the vector, in
+     * strings taken from paths when there is a pool.
      */
-    void read_filenames(const string &imgdir, vector<string *> &filenames)
+    void read_filenames(const string &imgdir, vector<string *> &filenames, object_pool<string> *paths = NULL)
     {
         DIR *dirPtr = NULL;
         dirPtr = opendir(imgdir.c_str());
@@ -68,11 +134,12 @@ namespace iwm
             struct dirent *filePtr = readdir(dirPtr);
             while (filePtr)
             {
-                if (iwm::is_valid_file(filePtr->d_name))
+                // subdirectories are only walked in recursive mode
+                if (iwm::is_valid_file(filePtr->d_name) && filePtr->d_type != DT_DIR)
                 {
                     // Build the real filename
-                    string *filepath = new string(imgdir);
-                    filepath->append(filePtr->d_name);
+                    string *filepath = paths != NULL ? paths->get() : new string();
+                    filepath->append(imgdir).append(filePtr->d_name);
 
                     filenames.push_back(filepath);
                 }
@@ -97,9 +164,84 @@ namespace iwm
     }
 
     /**
-     * Prints the stamp on the image inside the specified range
+     * Scalar kernel specialized on pixel type and channel count: prints the
+     * stamp on the image inside the specified range.
+     *
+     * Gray (C = 1) and gray+alpha (C = 2) images are lightened on channel 0,
+     * RGB (C = 3) and RGBA (C = 4) images get the gray scale of their first
+     * three channels; alpha is never touched.
+     *
+     * Walks the range row by row: CImg stores the channels as separate
+     * planes with x fastest, so every row is read through contiguous
+     * streams (the stamp row and one row per channel).
+     */
+    template <typename T, int C>
+    void print_stamp_planar(cimg_library::CImg<T> &image, cimg_library::CImg<T> &stamp, int left, int top, int width, int height)
+    {
+        const int endw = left + width;
+        const int endh = top + height;
+        const size_t plane = (size_t)image.width() * image.height();
+
+        for (int y = top; y < endh; y++)
+        {
+            const T *s = stamp.data(0, y);
+            T *r = image.data(0, y);
+
+            if (C >= 3)
+            {
+                T *g = r + plane;
+                T *b = g + plane;
+
+                for (int x = left; x < endw; x++)
+                {
+                    if (s[x] == 0)
+                    {
+                        T a = gray_sum_t<T>(r[x] + g[x] + b[x]);
+
+                        // update the source image
+                        r[x] = a;
+                        g[x] = a;
+                        b[x] = a;
+                    }
+                }
+            }
+            else
+            {
+                for (int x = left; x < endw; x++)
+                {
+                    if (s[x] == 0) r[x] = gray_sum_t<T>(3 * r[x]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Scalar kernel: dispatches on the spectrum of the image
+     */
+    void print_stamp_rows(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+    {
+        switch (image.spectrum())
+        {
+        case 1:
+            print_stamp_planar<CIMG_TYPE, 1>(image, stamp, left, top, width, height);
+            break;
+        case 2:
+            print_stamp_planar<CIMG_TYPE, 2>(image, stamp, left, top, width, height);
+            break;
+        case 3:
+            print_stamp_planar<CIMG_TYPE, 3>(image, stamp, left, top, width, height);
+            break;
+        default:
+            print_stamp_planar<CIMG_TYPE, 4>(image, stamp, left, top, width, height);
+            break;
+        }
+    }
+
+    /**
+     * Original column-major kernel, kept as reference for the kernel benchmark;
+     * RGB images only
      */
-    void print_stamp(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+    void print_stamp_columns(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
     {
         int endw = left + width;
         int endh = top + height;
@@ -110,7 +252,7 @@ namespace iwm
             {
                 if (is_black(stamp, x, y))
                 {
-                    int a = gray_scale(image(x, y, 0, 0), image(x, y, 0, 1), image(x, y, 0, 2));
+                    int a = gray_scale_reference(image(x, y, 0, 0), image(x, y, 0, 1), image(x, y, 0, 2));
 
                     // update the source image
                     image(x, y, 0, 0) = a;
@@ -120,6 +262,39 @@ namespace iwm
             }
         }
     }
+
+    /**
+     * Signature of a stamp kernel
+     */
+    typedef void (*stamp_kernel_t)(cimg_library::CImg<CIMG_TYPE> &, cimg_library::CImg<CIMG_TYPE> &, int, int, int, int);
+
+    /**
+     * Signature of the print_stamp entry point
+     */
+    typedef bool (*stamp_entry_t)(cimg_library::CImg<CIMG_TYPE> &, cimg_library::CImg<CIMG_TYPE> &, int, int, int, int);
+
+    /**
+     * Default entry point: the scalar kernel over the whole range
+     */
+    bool print_stamp_default(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+    {
+        print_stamp_rows(image, stamp, left, top, width, height);
+        return width > 0 && height > 0;
+    }
+
+    /**
+     * Entry point used by print_stamp, replaced at startup by iwm::kernel::use
+     */
+    stamp_entry_t stamp_entry = print_stamp_default;
+
+    /**
+     * Prints the stamp on the image inside the specified range.
+     * Returns false if the range does not intersect the stamp, leaving the image untouched.
+     */
+    bool print_stamp(cimg_library::CImg<CIMG_TYPE> &image, cimg_library::CImg<CIMG_TYPE> &stamp, int left, int top, int width, int height)
+    {
+        return stamp_entry(image, stamp, left, top, width, height);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -12,6 +12,9 @@
 // #define VERBOSE
 
 #include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
 #include "lib/CImg/CImg.h"
 
 #include "class/blocking_queue.cpp"
@@ -50,9 +53,9 @@ iwm::performance perf;
  */
 int main(int argc, char **argv)
 {
-    if (argc < 4)
+    if (argc < 5)
     {
-        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay>" << endl;
+        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes]" << endl;
         return 0;
     }
 
@@ -60,6 +63,9 @@ int main(int argc, char **argv)
     string imgDir = argv[2];
     string stampFilename = argv[3];
     int delay = atoi(argv[4]);
+    iwm::options opts(argc, argv, 5);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
 
     if(degree < 1)
     {
@@ -84,10 +90,24 @@ int main(int argc, char **argv)
         delay = 0;
     }
 
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
 #ifdef VERBOSE
     cout << "degree: " << degree << endl;
     cout << "imgDir: " << imgDir << endl;
     cout << "stampFilename: " << stampFilename << endl;
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
     cout << "delay: " << delay << endl;
 #endif
 
@@ -99,13 +119,18 @@ int main(int argc, char **argv)
     auto stamp_start = perf.now();
     try
     {
-        stamp = cimg_library::CImg<CIMG_TYPE>(stampFilename.c_str());
+        iwm::codec::load(stampFilename, stamp);
     }
     catch (cimg_library::CImgIOException &ex)
     {
         cerr << "Cannot load stamp image " << stampFilename << "(" << ex.what() << ")" << endl;
         return 1;
     }
+
+    // Compile the stamp into its span index or packed mask
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    const iwm::fitted_stamp_t &native = stamps->fit(stamp.width(), stamp.height());
+    const iwm::span_index *spans = native.spans;
     auto stamp_end = perf.now();
 
 #ifdef VERBOSE
@@ -150,6 +175,9 @@ int main(int argc, char **argv)
     auto end = perf.now();
     
     perf.setStampTime(stamp_start, stamp_end);
+    if(spans != NULL) perf.setStampSpans(spans->count(), spans->coverage());
+    perf.setStampBox(native.left, native.top, native.right, native.bottom);
+    perf.setStampFits(stamps->size());
     perf.setSetupTime(setup_start, setup_end);
     perf.setCompletionTime(start, end);
 
@@ -158,6 +186,8 @@ int main(int argc, char **argv)
     cout << "Version: ff_pipe" << endl;
     cout << "Parallelism Degree: " << degree << endl;
     cout << "Delay: " << delay << endl;
+    cout << "Kernel: " << iwm::kernel::active << endl;
+    cout << "Mask: " << mask << endl;
     perf.print();
 
     cout << "Bye!" << endl;
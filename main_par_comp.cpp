@@ -12,9 +12,23 @@
 // #define VERBOSE
 
 #include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
 #include "class/blocking_queue.cpp"
+#include "class/mpmc_queue.cpp"
+#include "class/band_map.cpp"
 #include "class/performance.cpp"
 #include "class/job.cpp"
+#include "class/dispatch.cpp"
+#include "class/order.cpp"
+#include "class/manifest.cpp"
+#include "class/listing.cpp"
+#include "class/dedup_cache.cpp"
+#include "class/memory_budget.cpp"
+#include "class/autotuner.cpp"
+#include "class/pool.cpp"
+#include "class/alloc_counter.cpp"
 #include "lib/CImg/CImg.h"
 
 using namespace std;
@@ -39,90 +53,152 @@ bool file_exists(const string &path)
 iwm::performance perf;
 
 /**
- * Send job to the worker i
+ * Global accounting of the decoded images
  */
-void send_to_worker(iwm::Job *job, int worker_idx, blocking_queue<iwm::Job *> *workers_queues[])
-{
-#ifdef VERBOSE
-    if(job != NULL) cout << "send_to_worker: " << *job << ", idx: " << worker_idx << endl;
-#endif
-    workers_queues[worker_idx]->push(job);
-}
+iwm::memory_budget *budget = NULL;
+
+/**
+ * Global controller of the active workers, NULL with a fixed degree
+ */
+iwm::autotuner *tuner = NULL;
+
+/**
+ * Global huge page arena of the decoded images, NULL to use the heap
+ */
+iwm::huge_arena *arena = NULL;
+
+/**
+ * Global manifest of the incremental mode, NULL to process every input
+ */
+iwm::manifest *manifest = NULL;
+
+/**
+ * Global cache of the emitter by input content, NULL to process duplicates
+ */
+iwm::dedup_cache *dedup = NULL;
 
 /**
- * Send the job to all workers
+ * Global pools of the jobs, the paths and the decoded images, handed back
+ * by the collector to the emitter and the loaders
  */
-void send_to_all_workers(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+iwm::object_pool<iwm::Job> *jobs = NULL;
+iwm::object_pool<string> *paths = NULL;
+iwm::image_pool *images = NULL;
+
+/**
+ * Global map workers, NULL if images are not split
+ */
+iwm::band_map *bands = NULL;
+
+/**
+ * Images are split in bands when at most map_queue other images wait for
+ * the worker (-1: always)
+ */
+int map_queue = 0;
+
+/**
+ * Applies the stamp to the image of the job, backlog jobs wait for the worker
+ */
+void stamp_job(iwm::Job *job, size_t backlog)
 {
-    for(int i = 0; i < nWorkers; i++)
+    cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
+
+    if(bands != NULL && (map_queue < 0 || (int)backlog <= map_queue))
+    {
+        job->setMapped(true);
+        job->setStamped(bands->print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+    else
     {
-        send_to_worker(job, i, workers_queues);
+        job->setStamped(iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
     }
 }
 
 /**
- * Send the job to workers in a round robin way
+ * Gives the path, the image and the job back to their pools
  */
-int next_worker_idx = -1;
-void send_to_worker_rr(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+void recycle(iwm::Job *job)
 {
-    next_worker_idx = (next_worker_idx + 1) % nWorkers;
-    send_to_worker(job, next_worker_idx, workers_queues);
+    string *filepath = job->getFilename();
+    if(filepath != NULL)
+    {
+        filepath->clear();
+        paths->put(filepath);
+    }
+    images->put(job->getImage());
+    job->reset();
+    jobs->put(job);
 }
 
 /**
- * Emitter: Load the image and send it to the workers
+ * Emitter: Load the image and send it to the workers. In stream mode the
+ * files are dispatched while the directory is still being read; with
+ * walkers the whole tree below it is read.
  */
-void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[], int delay)
+void emitter(const string &imgdir, const string &order, bool stream, int walkers, iwm::dispatcher *dispatch, int delay)
 {
 #ifdef VERBOSE
     cout << "Emitter starts! " << endl;
 #endif
-    try
+    auto start = perf.now();
+    bool first = true;
+    auto dispatch_file = [&](string *filepath)
     {
-        auto start = perf.now();
-        vector<string *> filenames;
-
-        iwm::read_filenames(imgdir, filenames);
-
-        auto stop = perf.now();
-
-        perf.setProcessed(filenames.size());
-        perf.setEmitterTime(start, stop);
-
-        bool first = true;
-        for(string *filepath : filenames)
+        // retard the dispatch of the filename
+        if(!first)
         {
-            // retard the dispatch of the filename
-            if(!first)
-            {
 #ifdef VERBOSE
-                cout << "retard dispatch by " << delay << "ms" << endl;
+            cout << "retard dispatch by " << delay << "ms" << endl;
 #endif
-                if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
-            }
-            else
-            {
-                first = false;
-            }
+            if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
+        }
+        else
+        {
+            // the emitter time is the time to the first dispatch
+            perf.setEmitterTime(start, perf.now());
+            first = false;
+        }
 
-            auto l_start = perf.now();
+        auto l_start = perf.now();
+
+        iwm::Job *job = jobs->get();
+        job->setFilename(filepath);
+
+        job->setTcommEmitterStart(l_start);
+
+        dispatch->push(job);
+    };
 
-            iwm::Job *job = new iwm::Job();
-            job->setFilename(filepath);
+    try
+    {
+        long walked;
+        if(stream)
+        {
+            perf.setProcessed(iwm::listing::stream(imgdir, walkers, paths, manifest, dispatch_file, walked), false);
+        }
+        else
+        {
+            vector<string *> filenames;
+            iwm::listing::batch(imgdir, walkers, paths, manifest, filenames, walked);
 
-            job->setTcommEmitterStart(l_start);
+            // Dispatch order and estimated cost of every job
+            perf.setSchedule(iwm::order::sort(order, filenames), dispatch->workers());
+            perf.setProcessed(filenames.size());
 
-            send_to_worker_rr(job, nWorkers, workers_queues);
+            for(string *filepath : filenames) dispatch_file(filepath);
         }
+        if(walkers > 0) perf.setWalk(walkers, walked);
     }
     catch(exception &ex)
     {
         cerr << "Cannot open image directory " << imgdir << endl;
     }
+    // the dispatch never started
+    if(first) perf.setEmitterTime(start, perf.now());
 
     // Send EOS to all workers
-    send_to_all_workers(EOS, nWorkers, workers_queues);
+    dispatch->close();
+    if(tuner != NULL) tuner->finish();
 
 #ifdef VERBOSE
     cout << "Emitter ends! " << endl;
@@ -132,37 +208,57 @@ void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *wor
 /**
  * Stage 1: load the image from the disk
  */
-void stage1(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+void stage1(iwm::dispatcher *dispatch, int idx, mpmc_queue<iwm::Job *> *output_queue)
 {
 #ifdef VERBOSE
     cout << "Stage 1 starts! " << endl;
 #endif
 
-    iwm::Job *job = input_queue->pop();
+    if(tuner != NULL) tuner->admit(idx);
+    iwm::Job *job = dispatch->pop(idx);
     while(job != EOS)
     {
+        // a duplicate gets the output of its content instead of being
+        // loaded, the cache keeps the path of a deferred one
+        iwm::dedup_cache::result_t seen = dedup != NULL ? dedup->lookup(job->getFilename()) : iwm::dedup_cache::MISS;
+        if(seen != iwm::dedup_cache::MISS)
+        {
+            if(seen == iwm::dedup_cache::DEFERRED) job->setFilename(NULL);
+            else if(manifest != NULL) manifest->done(*job->getFilename());
+            recycle(job);
+
+            if(tuner != NULL) tuner->admit(idx);
+            job = dispatch->pop(idx);
+            continue;
+        }
+
         try
         {
             auto l_start = perf.now();
 
             string *filepath = job->getFilename();
-            cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>(filepath->c_str());
+            size_t charged;
+            cimg_library::CImg<CIMG_TYPE> *image = budget->load(*filepath, charged, arena, idx);
 
             job->setImage(image);
+            job->setCharged(charged);
 
-            iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height());
+            stamp_job(job, dispatch->backlog(idx));
 
             string newfilename = iwm::get_new_filename(*filepath);
 
             try
             {
-                image->save(newfilename.c_str());
+                // an untouched image does not need to be encoded again
+                if(job->isStamped()) iwm::codec::save(*image, newfilename);
+                else iwm::codec::copy(*filepath, newfilename);
             }
             catch(cimg_library::CImgIOException &ex)
             {
     #ifdef VERBOSE
                 cerr << "Cannot store the image" << path << endl;
     #endif
+                job->setFailed(true);
             }
 
             auto l_stop = perf.now();
@@ -180,10 +276,13 @@ void stage1(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 #ifdef VERBOSE
             cerr << "Cannot load " << job->getFilename() << endl;
 #endif
+            if(dedup != NULL) dedup->failed(*job->getFilename());
+            recycle(job);
         }
 
-        // Take another job
-        job = input_queue->pop();
+        // Take another job, once this worker is active
+        if(tuner != NULL) tuner->admit(idx);
+        job = dispatch->pop(idx);
     }
 
     // Forwarding the EOS
@@ -197,7 +296,7 @@ void stage1(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 /**
  * Collector: collects jobs and update performances results
  */
-void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
+void collector(int degree, mpmc_queue<iwm::Job *> *input_queue)
 {
 #ifdef VERBOSE
     cout << "Collector starts! " << endl;
@@ -218,8 +317,23 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
             job->setTcommStage1End(end);
 
             perf.registerJob(job);
-
-            delete job;
+            if(tuner != NULL) tuner->departure(job->getPerfEntry().tcomm_stage1.first);
+
+            budget->release(job->getCharged());
+            // a failed output is rebuilt by the next incremental run
+            if(manifest != NULL && !job->isFailed()) manifest->done(*job->getFilename());
+            // the duplicates of a failed output are dropped with it
+            if(dedup != NULL && job->isFailed()) dedup->failed(*job->getFilename());
+            else if(dedup != NULL)
+            {
+                for(string *duplicate : dedup->done(*job->getFilename(), job->getPerfEntry().work()))
+                {
+                    if(manifest != NULL) manifest->done(*duplicate);
+                    delete duplicate;
+                }
+            }
+            if(arena != NULL) arena->release(job->getImage());
+            recycle(job);
         }
         else
         {
@@ -237,9 +351,9 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
  */
 int main(int argc, char **argv)
 {
-    if (argc < 4)
+    if (argc < 5)
     {
-        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay>" << endl;
+        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes] [--map <workers>] [--map-queue <jobs>] [--dispatch rr|shared|steal|ondemand] [--backlog <jobs>] [--order readdir|size|lpt] [--list stream|batch] [--recursive] [--walkers <threads>] [--incremental [<manifest>]] [--dedup] [--queue-cap <jobs>] [--budget <MB>] [--arena off|thp|explicit] [--pool <images>] [--autotune] [--tune-start <workers>] [--tune-window <jobs per worker>] [--wait spin|yield|park]" << endl;
         return 0;
     }
 
@@ -247,6 +361,29 @@ int main(int argc, char **argv)
     string imgDir = argv[2];
     string stampFilename = argv[3];
     int delay = atoi(argv[4]);
+    iwm::options opts(argc, argv, 5);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
+    int map_workers = opts.getInt("map", 0);
+    map_queue = opts.getInt("map-queue", 0);
+    // with autotune the degree is the maximum number of workers, and they have to pull their jobs
+    bool autotune = opts.has("autotune");
+    int tune_start = opts.getInt("tune-start", 2);
+    int tune_window = opts.getInt("tune-window", 2);
+    string dispatch_name = opts.get("dispatch", autotune ? "shared" : "rr");
+    int backlog = opts.getInt("backlog", 1);
+    string order = opts.get("order", "readdir");
+    // only the directory order can be dispatched before the listing ends
+    string list = opts.get("list", order == "readdir" ? "stream" : "batch");
+    // walk the subdirectories too, with walkers threads
+    int walkers = opts.has("recursive") ? opts.getInt("walkers", 2) : 0;
+    int queue_cap = opts.getInt("queue-cap", 0);
+    int budget_mb = opts.getInt("budget", 0);
+    string arena_mode = opts.get("arena", "off");
+    // jobs, paths and decoded images kept for reuse (0: allocate them for every image)
+    int pool_size = opts.getInt("pool", 4 * degree);
+    string wait_name = opts.get("wait", "park");
+    wait_strategy wait;
 
     if(degree < 1)
     {
@@ -271,10 +408,86 @@ int main(int argc, char **argv)
         delay = 0;
     }
 
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
+    if(!parse_wait_strategy(wait_name, wait))
+    {
+        cerr << "unsupported wait strategy: " << wait_name << endl;
+        return 1;
+    }
+
+    if(map_workers < 0)
+    {
+        cerr << "invalid map workers: " << map_workers << endl;
+        return 1;
+    }
+
+    if(!iwm::order::valid(order))
+    {
+        cerr << "unsupported order: " << order << endl;
+        return 1;
+    }
+
+    if((list != "stream" && list != "batch") || (list == "stream" && order != "readdir"))
+    {
+        cerr << "unsupported list: " << list << " (stream needs --order readdir)" << endl;
+        return 1;
+    }
+    bool stream = list == "stream";
+
+    if(opts.has("recursive") && walkers < 1)
+    {
+        cerr << "invalid walkers: " << walkers << endl;
+        return 1;
+    }
+
+    if(queue_cap < 0 || budget_mb < 0 || pool_size < 0)
+    {
+        cerr << "invalid queue capacity, memory budget or pool size" << endl;
+        return 1;
+    }
+
+    if(arena_mode != "off" && arena_mode != "thp" && arena_mode != "explicit")
+    {
+        cerr << "unsupported arena: " << arena_mode << endl;
+        return 1;
+    }
+
+    if(backlog < 1)
+    {
+        cerr << "invalid backlog: " << backlog << endl;
+        return 1;
+    }
+
+    if(autotune && ((dispatch_name != "shared" && dispatch_name != "steal") || tune_start < 1 || tune_window < 1))
+    {
+        cerr << "autotune needs --dispatch shared|steal, a start of 1+ workers and a window of 1+ jobs per worker" << endl;
+        return 1;
+    }
+
+    iwm::dispatcher *dispatch = iwm::dispatcher::create(dispatch_name, degree, wait, backlog, queue_cap);
+    if(dispatch == NULL)
+    {
+        cerr << "unsupported dispatch: " << dispatch_name << endl;
+        return 1;
+    }
+
 #ifdef VERBOSE
     cout << "degree: " << degree << endl;
     cout << "imgDir: " << imgDir << endl;
     cout << "stampFilename: " << stampFilename << endl;
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
     cout << "delay: " << delay << endl;
 #endif
 
@@ -286,13 +499,29 @@ int main(int argc, char **argv)
     // Prepare stamp image
     try
     {
-        stamp = cimg_library::CImg<CIMG_TYPE>(stampFilename.c_str());
+        iwm::codec::load(stampFilename, stamp);
     }
     catch (cimg_library::CImgIOException &ex)
     {
         cerr << "Cannot load stamp image " << stampFilename << "(" << ex.what() << ")" << endl;
         return 1;
     }
+
+    // Inputs whose output is up to date with this stamp are skipped
+    string manifest_path = opts.get("incremental", "");
+    if(opts.has("incremental"))
+    {
+        uint64_t stamp_hash = 0;
+        iwm::hash::file(stampFilename, stamp_hash);
+        if(manifest_path.empty()) manifest_path = imgDir + MANIFEST_NAME;
+        manifest = new iwm::manifest(manifest_path, stamp_hash);
+    }
+
+    // Compile the stamp into its span index or packed mask
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    const iwm::fitted_stamp_t &native = stamps->fit(stamp.width(), stamp.height());
+    const iwm::span_index *spans = native.spans;
+
 #ifdef VERBOSE
     cout << "Done!" << endl;
 
@@ -302,22 +531,38 @@ int main(int argc, char **argv)
     auto stamp_end = perf.now();
 
     auto setup_start = perf.now();
+    const long allocations = iwm::alloc_counter::calls();
     // Setting up the farm
 
+    jobs = new iwm::object_pool<iwm::Job>(pool_size);
+    paths = new iwm::object_pool<string>(pool_size);
+    images = new iwm::image_pool(pool_size);
+    budget = new iwm::memory_budget((size_t)budget_mb << 20, images);
+
+    // Byte-identical inputs share the output of the first of them
+    if(opts.has("dedup")) dedup = new iwm::dedup_cache();
+
+    // Decoded images in huge pages, pre-faulted by each load worker
+    if(arena_mode != "off") arena = new iwm::huge_arena(degree, arena_mode == "explicit");
+
+    // Band workers shared by the farm workers
+    if(map_workers > 0) bands = new iwm::band_map(map_workers);
+
+    // Only the first workers take jobs until the controller grows the farm
+    if(autotune) tuner = new iwm::autotuner(tune_start, degree, tune_window);
+
     // preparing the pipelines
-    blocking_queue<iwm::Job *> **stage1_queue = new blocking_queue<iwm::Job *> *[degree];
     thread *stage1_workers[degree];
 
-    blocking_queue<iwm::Job *> *collector_queue = new blocking_queue<iwm::Job *>();
+    mpmc_queue<iwm::Job *> *collector_queue = new mpmc_queue<iwm::Job *>(MPMC_CAPACITY, wait);
 
     for(int i = 0; i < degree; i++)
     {
-        stage1_queue[i] = new blocking_queue<iwm::Job *>();
-        stage1_workers[i] = new thread(stage1, stage1_queue[i], collector_queue);
+        stage1_workers[i] = new thread(stage1, dispatch, i, collector_queue);
     }
 
     thread th_collector = thread(collector, degree, collector_queue);
-    thread th_emitter = thread(emitter, imgDir, degree, stage1_queue, delay);
+    thread th_emitter = thread(emitter, imgDir, order, stream, walkers, dispatch, delay);
 
     auto setup_end = perf.now();
 
@@ -340,21 +585,36 @@ int main(int argc, char **argv)
     }
 
     th_collector.join();
+    perf.setPools({ jobs->hits(), jobs->misses() }, { paths->hits(), paths->misses() }, { images->hits(), images->misses() }, iwm::alloc_counter::calls() - allocations);
+
+    if(manifest != NULL && !manifest->save()) cerr << "Cannot write the manifest " << manifest_path << endl;
+    if(dedup != NULL) perf.setDedup(dedup->hits(), dedup->misses(), dedup->saved(), dedup->hashing());
 
     // Free resources
     for(int i = 0; i < degree; i++)
     {
-        delete stage1_queue[i];
-
         delete stage1_workers[i];
     }
 
-    delete[] stage1_queue;
+    perf.setWorkerStats(dispatch->stats());
+    delete dispatch;
     delete collector_queue;
 
+    delete bands;
+
+    perf.setMemory(budget->limit(), budget->peak(), budget->waits());
+    delete budget;
+    delete jobs;
+    delete paths;
+    delete images;
+
     auto end = perf.now();
 
     perf.setStampTime(stamp_start, stamp_end);
+    if(spans != NULL) perf.setStampSpans(spans->count(), spans->coverage());
+    perf.setStampBox(native.left, native.top, native.right, native.bottom);
+    perf.setStampFits(stamps->size());
+    perf.setMapWorkers(map_workers);
     perf.setSetupTime(setup_start, setup_end);
     perf.setCompletionTime(start, end);
 
@@ -363,8 +623,35 @@ int main(int argc, char **argv)
     cout << "Version: par_comp" << endl;
     cout << "Parallelism Degree: " << degree << endl;
     cout << "Delay: " << delay << endl;
+    cout << "Kernel: " << iwm::kernel::active << endl;
+    cout << "Mask: " << mask << endl;
+    cout << "Map queue: " << map_queue << endl;
+    cout << "Dispatch: " << dispatch_name << endl;
+    if(dispatch_name == "ondemand") cout << "Backlog: " << backlog << endl;
+    cout << "Order: " << order << endl;
+    cout << "List: " << (stream ? "stream" : "batch") << endl;
+    if(manifest != NULL) cout << "Incremental: " << manifest->fresh() << " up to date (" << manifest_path << ")" << endl;
+    cout << "Queue capacity: " << queue_cap << endl;
+    cout << "Pool: " << pool_size << endl;
+    cout << "Arena: " << arena_mode;
+    if(arena != NULL) cout << " (" << arena->mapped() << " regions mapped, " << arena->reused() << " reused, " << arena->fallbacks() << " explicit fallbacks)";
+    cout << endl;
+    if(tuner != NULL)
+    {
+        cout << "Autotune: degree " << tuner->degree() << (tuner->converged() ? "" : " (not converged)")
+             << ", start " << tune_start << ", window " << tune_window << " jobs per worker" << endl;
+        cout << "Autotune trajectory (workers:jobs/s):";
+        for(const iwm::tune_step_t &step : tuner->trajectory()) cout << " " << step.degree << ":" << step.throughput;
+        cout << endl;
+    }
+    cout << "Wait: " << wait_name << endl;
     perf.print();
 
+    delete tuner;
+    delete arena;
+    delete manifest;
+    delete dedup;
+
     cout << "Done!" << endl;
 
     return 0;
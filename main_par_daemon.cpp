@@ -0,0 +1,562 @@
+#include <iostream>
+#include <vector>
+#include <exception>
+#include <dirent.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define EOS NULL
+
+// #define VERBOSE
+
+#include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
+#include "class/blocking_queue.cpp"
+#include "class/mpmc_queue.cpp"
+#include "class/band_map.cpp"
+#include "class/performance.cpp"
+#include "class/job.cpp"
+#include "class/dispatch.cpp"
+#include "class/pool.cpp"
+#include "class/alloc_counter.cpp"
+#include "lib/CImg/CImg.h"
+
+using namespace std;
+
+/**
+ * Global stamp image
+ */
+cimg_library::CImg<CIMG_TYPE> stamp;
+
+/**
+ * Check whether a file exists
+ */
+bool file_exists(const string &path)
+{
+    ifstream ifile(path);
+    return (bool)ifile;
+}
+
+/**
+ * Global performance collector, only its clock is used: the server does
+ * not keep the entries of the jobs
+ */
+iwm::performance perf;
+
+/**
+ * Global map workers, NULL if images are not split
+ */
+iwm::band_map *bands = NULL;
+
+/**
+ * Images are split in bands when at most map_queue other images wait for
+ * the worker (-1: always)
+ */
+int map_queue = 0;
+
+/**
+ * A job of a request, sent back to the connection waiting for it
+ */
+class request_job : public iwm::Job
+{
+private:
+    blocking_queue<request_job *> *_done = NULL;
+
+public:
+    void setDone(blocking_queue<request_job *> *done)
+    {
+        _done = done;
+    }
+
+    blocking_queue<request_job *> *getDone()
+    {
+        return _done;
+    }
+};
+
+/**
+ * Global pools of the jobs and of the decoded images
+ */
+iwm::object_pool<request_job> *jobs = NULL;
+iwm::image_pool *images = NULL;
+
+/**
+ * Server state and totals
+ */
+atomic<bool> stopping(false);
+int listen_fd = -1;
+
+/**
+ * The connections share the emitter side of the dispatcher
+ */
+mutex dispatch_mutex;
+
+/**
+ * Open connections: they run in detached threads, so that a finished one
+ * frees its stack right away, and the server waits for live_connections
+ * to drop to 0 before stopping the workers
+ */
+mutex connections_mutex;
+condition_variable connections_closed;
+vector<int> connection_fds;
+int live_connections = 0;
+
+atomic<long> served_requests(0);
+atomic<long> served_images(0);
+
+/**
+ * Applies the stamp to the image of the job, backlog jobs wait for the worker
+ */
+void stamp_job(iwm::Job *job, size_t backlog)
+{
+    cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
+
+    if(bands != NULL && (map_queue < 0 || (int)backlog <= map_queue))
+    {
+        job->setMapped(true);
+        job->setStamped(bands->print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+    else
+    {
+        job->setStamped(iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+}
+
+/**
+ * Worker: load, stamp and store the images of the requests
+ */
+void worker(iwm::dispatcher *dispatch, int idx)
+{
+    request_job *job = static_cast<request_job *>(dispatch->pop(idx));
+    while(job != EOS)
+    {
+        string *filepath = job->getFilename();
+        job->setFailed(false);
+        try
+        {
+            auto l_start = perf.now();
+
+            // decode into a recycled buffer of the size announced by the header
+            int width, height, spectrum;
+            size_t values = iwm::codec::dimensions(*filepath, width, height, spectrum) ? (size_t)width * height * spectrum : 0;
+            cimg_library::CImg<CIMG_TYPE> *image = images->get(values);
+            job->setImage(image);
+            iwm::codec::load(*filepath, *image);
+
+            auto l_loaded = perf.now();
+            job->setLatencyStage1(l_start, l_loaded);
+
+            stamp_job(job, dispatch->backlog(idx));
+
+            auto l_stamped = perf.now();
+            job->setLatencyStage2(l_loaded, l_stamped);
+
+            string newfilename = iwm::get_new_filename(*filepath);
+            try
+            {
+                // an untouched image does not need to be encoded again
+                if(job->isStamped()) iwm::codec::save(*image, newfilename);
+                else iwm::codec::copy(*filepath, newfilename);
+            }
+            catch(cimg_library::CImgIOException &ex)
+            {
+#ifdef VERBOSE
+                cerr << "Cannot store the image" << *filepath << endl;
+#endif
+                job->setFailed(true);
+            }
+
+            job->setLatencyStage3(l_stamped, perf.now());
+        }
+        catch(cimg_library::CImgIOException &ex)
+        {
+#ifdef VERBOSE
+            cerr << "Cannot load " << *filepath << endl;
+#endif
+            job->setFailed(true);
+        }
+
+        job->getDone()->push(job);
+
+        // Take another job
+        job = static_cast<request_job *>(dispatch->pop(idx));
+    }
+}
+
+/**
+ * Writes the whole line to the client, false if it went away
+ */
+bool reply(int fd, const string &line)
+{
+    size_t sent = 0;
+    while(sent < line.size())
+    {
+        ssize_t n = write(fd, line.data() + sent, line.size() - sent);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+/**
+ * Appends the path, or the files of the directory, to the request
+ */
+void add_path(const string &path, vector<string *> &filenames)
+{
+    struct stat info;
+    if(stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        vector<string *> listed;
+        try
+        {
+            iwm::read_filenames(path.back() == '/' ? path : path + "/", listed);
+        }
+        catch(exception &ex)
+        {
+        }
+        filenames.insert(filenames.end(), listed.begin(), listed.end());
+    }
+    else
+    {
+        filenames.push_back(new string(path));
+    }
+}
+
+/**
+ * Runs one request on the hot workers and streams the completion of every
+ * image back to the client, in completion order. The allocations reported
+ * are those of the whole process while the request ran, concurrent
+ * requests included.
+ */
+bool run_request(int fd, iwm::dispatcher *dispatch, vector<string *> &filenames)
+{
+    auto start = perf.now();
+    long allocations = iwm::alloc_counter::calls();
+
+    blocking_queue<request_job *> done;
+    {
+        lock_guard<mutex> lock(dispatch_mutex);
+        for(string *filepath : filenames)
+        {
+            request_job *job = jobs->get();
+            job->setFilename(filepath);
+            job->setDone(&done);
+            job->setLatencyStart(perf.now());
+            dispatch->push(job);
+        }
+    }
+
+    bool connected = true;
+    char line[64];
+    for(size_t i = 0; i < filenames.size(); i++)
+    {
+        request_job *job = done.pop();
+        job->setLatencyEnd(perf.now());
+
+        perf_entry_t entry = job->getPerfEntry();
+        if(!job->isFailed())
+        {
+            snprintf(line, sizeof(line), "ok %.3f ", chrono::duration<double, milli>(entry.latency.second - entry.latency.first).count());
+            connected = connected && reply(fd, line + *job->getFilename() + "\n");
+        }
+        else
+        {
+            connected = connected && reply(fd, "error " + *job->getFilename() + "\n");
+        }
+
+        // the collector side gives the buffer and the job back to the workers
+        images->put(job->getImage());
+        delete job->getFilename();
+        job->reset();
+        jobs->put(job);
+    }
+
+    allocations = iwm::alloc_counter::calls() - allocations;
+    const double elapsed = chrono::duration<double, milli>(perf.now() - start).count();
+    served_requests++;
+    served_images += filenames.size();
+
+    snprintf(line, sizeof(line), "done %zu %.3f %.1f\n", filenames.size(), elapsed, filenames.empty() ? 0.0 : (double)allocations / filenames.size());
+    cout << "request: " << filenames.size() << " images, " << elapsed << " ms, " << allocations << " allocations (process)" << endl;
+    return connected && reply(fd, line);
+}
+
+/**
+ * Stops accepting connections and wakes the idle ones
+ */
+void stop_server()
+{
+    stopping = true;
+    shutdown(listen_fd, SHUT_RDWR);
+
+    lock_guard<mutex> lock(connections_mutex);
+    for(int fd : connection_fds) shutdown(fd, SHUT_RD);
+}
+
+/**
+ * Connection: every line is a path (image or directory), an empty line
+ * (or the end of the input) runs the request; "shutdown" stops the server
+ */
+void serve(int fd, iwm::dispatcher *dispatch)
+{
+    FILE *in = fdopen(dup(fd), "r");
+    vector<string *> filenames;
+    char buffer[PATH_MAX + 2];
+
+    bool open = in != NULL;
+    while(open)
+    {
+        open = fgets(buffer, sizeof(buffer), in) != NULL;
+
+        string line = open ? buffer : "";
+        while(!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+
+        if(line == "shutdown")
+        {
+            reply(fd, "bye\n");
+            stop_server();
+            break;
+        }
+
+        if(!line.empty())
+        {
+            add_path(line, filenames);
+        }
+        else if(!filenames.empty() || open)
+        {
+            if(!run_request(fd, dispatch, filenames)) break;
+            filenames.clear();
+        }
+    }
+
+    for(string *filepath : filenames) delete filepath;
+    if(in != NULL) fclose(in);
+
+    lock_guard<mutex> lock(connections_mutex);
+    connection_fds.erase(find(connection_fds.begin(), connection_fds.end(), fd));
+    close(fd);
+
+    // notified under the lock: the server may return as soon as it gets it
+    live_connections--;
+    connections_closed.notify_all();
+}
+
+/**
+ * Main: validate the input, set up the workers and serve the requests.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        cout << ": usage: <par_degree> <socketPath> <stampFilename> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes] [--map <workers>] [--map-queue <jobs>] [--dispatch rr|shared|steal|ondemand] [--backlog <jobs>] [--pool <images>] [--wait spin|yield|park]" << endl;
+        return 0;
+    }
+
+    int degree = atoi(argv[1]);
+    string socketPath = argv[2];
+    string stampFilename = argv[3];
+    iwm::options opts(argc, argv, 4);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
+    int map_workers = opts.getInt("map", 0);
+    map_queue = opts.getInt("map-queue", 0);
+    string dispatch_name = opts.get("dispatch", "shared");
+    int backlog = opts.getInt("backlog", 1);
+    // jobs and decoded images kept for reuse (0: allocate them for every image)
+    int pool_size = opts.getInt("pool", 4 * degree);
+    string wait_name = opts.get("wait", "park");
+    wait_strategy wait;
+
+    if(degree < 1)
+    {
+        cerr << "invalid parallelism degree: " << degree << endl;
+        return 1;
+    }
+
+    if(!file_exists(stampFilename))
+    {
+        cerr << "Stamp not found: " << stampFilename << endl;
+        return 1;
+    }
+
+    if(socketPath.size() >= sizeof(((sockaddr_un *)NULL)->sun_path))
+    {
+        cerr << "Socket path too long: " << socketPath << endl;
+        return 1;
+    }
+
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
+    if(!parse_wait_strategy(wait_name, wait))
+    {
+        cerr << "unsupported wait strategy: " << wait_name << endl;
+        return 1;
+    }
+
+    if(map_workers < 0 || backlog < 1 || pool_size < 0)
+    {
+        cerr << "invalid map workers, backlog or pool size" << endl;
+        return 1;
+    }
+
+    if(!iwm::dispatcher::valid(dispatch_name))
+    {
+        cerr << "unsupported dispatch: " << dispatch_name << endl;
+        return 1;
+    }
+
+    auto stamp_start = perf.now();
+
+    // Prepare stamp image, once for all the requests
+    try
+    {
+        iwm::codec::load(stampFilename, stamp);
+    }
+    catch (cimg_library::CImgIOException &ex)
+    {
+        cerr << "Cannot load stamp image " << stampFilename << "(" << ex.what() << ")" << endl;
+        return 1;
+    }
+
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    stamps->fit(stamp.width(), stamp.height());
+
+    auto stamp_end = perf.now();
+
+    auto setup_start = perf.now();
+
+    // Listen before starting the workers
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    // a socket a server still answers on is an error, a stale one (left by
+    // a crash) is replaced; bind fails on any other file
+    struct stat info;
+    if(lstat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool live = probe_fd >= 0 && connect(probe_fd, (sockaddr *)&address, sizeof(address)) == 0;
+        if(probe_fd >= 0) close(probe_fd);
+        if(live)
+        {
+            cerr << "Socket in use: " << socketPath << endl;
+            return 1;
+        }
+        unlink(socketPath.c_str());
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0 || ::bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 16) != 0)
+    {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // a client that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    jobs = new iwm::object_pool<request_job>(pool_size);
+    images = new iwm::image_pool(pool_size);
+
+    if(map_workers > 0) bands = new iwm::band_map(map_workers);
+
+    iwm::dispatcher *dispatch = iwm::dispatcher::create(dispatch_name, degree, wait, backlog);
+
+    vector<thread *> workers;
+    for(int i = 0; i < degree; i++) workers.push_back(new thread(worker, dispatch, i));
+
+    auto setup_end = perf.now();
+
+    cout << "---Server---" << endl;
+    cout << "Socket: " << socketPath << endl;
+    cout << "Parallelism Degree: " << degree << endl;
+    cout << "Kernel: " << iwm::kernel::active << endl;
+    cout << "Mask: " << mask << endl;
+    cout << "Dispatch: " << dispatch_name << endl;
+    cout << "Pool: " << pool_size << endl;
+    cout << "Stamp loading: " << chrono::duration<double, milli>(stamp_end - stamp_start).count() << endl;
+    cout << "Setup: " << chrono::duration<double, milli>(setup_end - setup_start).count() << endl;
+
+    // Serve the connections until a client asks for the shutdown
+    const long allocations = iwm::alloc_counter::calls();
+    while(!stopping)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR && !stopping) continue;
+            break;
+        }
+
+        lock_guard<mutex> lock(connections_mutex);
+        if(stopping)
+        {
+            close(fd);
+            break;
+        }
+        connection_fds.push_back(fd);
+        live_connections++;
+        thread(serve, fd, dispatch).detach();
+    }
+
+    {
+        unique_lock<mutex> lock(connections_mutex);
+        connections_closed.wait(lock, [] { return live_connections == 0; });
+    }
+
+    dispatch->close();
+    for(thread *w : workers)
+    {
+        w->join();
+        delete w;
+    }
+    const long served_allocations = iwm::alloc_counter::calls() - allocations;
+
+    close(listen_fd);
+    unlink(socketPath.c_str());
+
+    cout << "---Results---" << endl;
+    cout << "Requests: " << served_requests << endl;
+    cout << "Images: " << served_images << endl;
+    cout << "Job pool: " << jobs->hits() << " hits, " << jobs->misses() << " misses" << endl;
+    cout << "Image pool: " << images->hits() << " hits, " << images->misses() << " misses" << endl;
+    cout << "Allocations per image: " << (served_images > 0 ? (double)served_allocations / served_images : 0) << endl;
+
+    delete dispatch;
+    delete bands;
+    delete jobs;
+    delete images;
+
+    cout << "Done!" << endl;
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include <chrono>
 #include <thread>
 #include <fstream>
+#include <atomic>
 
 #define EOS NULL
 #define TIME_UNIT chrono::milliseconds
@@ -14,9 +15,23 @@
 // #define VERBOSE
 
 #include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
 #include "class/blocking_queue.cpp"
+#include "class/mpmc_queue.cpp"
+#include "class/spsc_queue.cpp"
+#include "class/band_map.cpp"
 #include "class/performance.cpp"
 #include "class/job.cpp"
+#include "class/dispatch.cpp"
+#include "class/order.cpp"
+#include "class/manifest.cpp"
+#include "class/listing.cpp"
+#include "class/dedup_cache.cpp"
+#include "class/memory_budget.cpp"
+#include "class/pool.cpp"
+#include "class/alloc_counter.cpp"
 #include "lib/CImg/CImg.h"
 
 using namespace std;
@@ -41,90 +56,261 @@ bool file_exists(const string &path)
 iwm::performance perf;
 
 /**
- * Send job to the worker i
+ * Global accounting of the decoded images
  */
-void send_to_worker(iwm::Job *job, int worker_idx, blocking_queue<iwm::Job *> *workers_queues[])
+iwm::memory_budget *budget = NULL;
+
+/**
+ * Global huge page arena of the decoded images, NULL to use the heap
+ */
+iwm::huge_arena *arena = NULL;
+
+/**
+ * Global manifest of the incremental mode, NULL to process every input
+ */
+iwm::manifest *manifest = NULL;
+
+/**
+ * Global cache of the emitter by input content, NULL to process duplicates
+ */
+iwm::dedup_cache *dedup = NULL;
+
+/**
+ * Global pools of the jobs, the paths and the decoded images, handed back
+ * by the collector to the emitter and the loaders
+ */
+iwm::object_pool<iwm::Job> *jobs = NULL;
+iwm::object_pool<string> *paths = NULL;
+iwm::image_pool *images = NULL;
+
+/**
+ * Global map workers, NULL if images are not split
+ */
+iwm::band_map *bands = NULL;
+
+/**
+ * Images are split in bands when at most map_queue other images wait for
+ * the worker (-1: always)
+ */
+int map_queue = 0;
+
+/**
+ * Applies the stamp to the image of the job, backlog jobs wait for the worker
+ */
+void stamp_job(iwm::Job *job, size_t backlog)
+{
+    cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
+
+    if(bands != NULL && (map_queue < 0 || (int)backlog <= map_queue))
+    {
+        job->setMapped(true);
+        job->setStamped(bands->print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+    else
+    {
+        job->setStamped(iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+}
+
+/**
+ * Workers of one stage sharing their input and output queues, NULL for
+ * the stages of the 1:1:1 pipelines
+ */
+struct pool_t
 {
+    atomic<int> running;
+
+    /**
+     * Workers of the next stage
+     */
+    int next;
+
+    pool_t(int workers, int next_workers) : running(workers), next(next_workers)
+    {
+    }
+};
+
+/**
+ * End of stream of a stage worker: the last worker of a pool sends one EOS
+ * to each worker of the next stage
+ */
+template <typename Q>
+void forward_eos(pool_t *pool, Q *output_queue)
+{
+    if(pool == NULL) output_queue->push(EOS);
+    else if(pool->running.fetch_sub(1) == 1) for(int i = 0; i < pool->next; i++) output_queue->push(EOS);
+}
+
+/**
+ * Decodes the image of the job for load worker i, false if it cannot be
+ * loaded or is a duplicate
+ */
+bool load_job(iwm::Job *job, int worker)
+{
+    // a duplicate gets the output of its content instead of being loaded,
+    // the cache keeps the path of a deferred one
+    iwm::dedup_cache::result_t seen = dedup != NULL ? dedup->lookup(job->getFilename()) : iwm::dedup_cache::MISS;
+    if(seen == iwm::dedup_cache::DEFERRED)
+    {
+        job->setFilename(NULL);
+        return false;
+    }
+    if(seen == iwm::dedup_cache::HIT)
+    {
+        if(manifest != NULL) manifest->done(*job->getFilename());
+        return false;
+    }
+
+    try
+    {
+        auto l_start = perf.now();
+
+        string *filepath = job->getFilename();
+        size_t charged;
+        cimg_library::CImg<CIMG_TYPE> *image = budget->load(*filepath, charged, arena, worker);
+
+        job->setImage(image);
+        job->setCharged(charged);
+
+        auto l_stop = perf.now();
+
+        job->setLatencyStart(l_start);
+        job->setTcommEmitterEnd(l_start);
+        job->setLatencyStage1(l_start, l_stop);
+        return true;
+    }
+    catch(cimg_library::CImgIOException &ex)
+    {
 #ifdef VERBOSE
-    if(job != NULL) cout << "send_to_worker: " << *job->getFilename() << ", idx: " << worker_idx << endl;
+        cerr << "Cannot load " << job->getFilename() << endl;
 #endif
-    workers_queues[worker_idx]->push(job);
+        if(dedup != NULL) dedup->failed(*job->getFilename());
+        return false;
+    }
 }
 
 /**
- * Send the job to all workers
+ * Stores the image of the job to the disk
  */
-void send_to_all_workers(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+void store_job(iwm::Job *job)
 {
-    for(int i = 0; i < nWorkers; i++)
+    auto l_start = perf.now();
+
+    cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
+    string *path = job->getFilename();
+
+    string newfilename = iwm::get_new_filename(*path);
+
+    try
     {
-        send_to_worker(job, i, workers_queues);
+        // an untouched image does not need to be encoded again
+        if(job->isStamped()) iwm::codec::save(*image, newfilename);
+        else iwm::codec::copy(*path, newfilename);
+    }
+    catch(cimg_library::CImgIOException &ex)
+    {
+#ifdef VERBOSE
+        cerr << "Cannot store the image" << path << endl;
+#endif
+        job->setFailed(true);
     }
+
+    auto l_stop = perf.now();
+    job->setTcommStage2End(l_start);
+    job->setLatencyStage3(l_start, l_stop);
 }
 
 /**
- * Send the job to workers in a round robin way
+ * Gives the path, the image and the job back to their pools
  */
-int next_worker_idx = -1;
-void send_to_worker_rr(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+void recycle(iwm::Job *job)
 {
-    next_worker_idx = (next_worker_idx + 1) % nWorkers;
-    send_to_worker(job, next_worker_idx, workers_queues);
+    string *filepath = job->getFilename();
+    if(filepath != NULL)
+    {
+        filepath->clear();
+        paths->put(filepath);
+    }
+    images->put(job->getImage());
+    job->reset();
+    jobs->put(job);
 }
 
 /**
- * Emitter: Load the image and send it to the workers
+ * Emitter: Load the image and send it to the workers. The files left by
+ * the probe, if any, replace the directory listing; in stream mode the
+ * files are dispatched while the directory is still being read. With
+ * walkers the whole tree below it is read.
  */
-void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[], int delay)
+void emitter(const string &imgdir, const string &order, bool stream, int walkers, iwm::dispatcher *dispatch, int delay, vector<string *> *listed, int probed)
 {
 #ifdef VERBOSE
     cout << "Emitter starts! " << endl;
 #endif
-    try
+    auto start = perf.now();
+    bool first = true;
+    auto dispatch_file = [&](string *filepath)
     {
-        auto start = perf.now();
-        vector<string *> filenames;
+        // retard the dispatch of the filename
+        if(!first)
+        {
+#ifdef VERBOSE
+            cout << "retard dispatch by " << delay << "ms" << endl;
+#endif
+            if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
+        }
+        else
+        {
+            // the emitter time is the time to the first dispatch
+            perf.setEmitterTime(start, perf.now());
+            first = false;
+        }
+
+        auto l_start = perf.now();
 
-        iwm::read_filenames(imgdir, filenames);
+        iwm::Job *job = jobs->get();
+        job->setFilename(filepath);
 
-        auto stop = perf.now();
+        job->setTcommEmitterStart(l_start);
 
-        perf.setProcessed(filenames.size());
-        perf.setEmitterTime(start, stop);
+        dispatch->push(job);
+    };
 
-        bool first = true;
-        for(string *filepath : filenames)
+    try
+    {
+        long walked;
+        if(stream)
         {
-            // retard the dispatch of the filename
-            if(!first)
-            {
-#ifdef VERBOSE
-                cout << "retard dispatch by " << delay << "ms" << endl;
-#endif
-                if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
-            }
+            perf.setProcessed(iwm::listing::stream(imgdir, walkers, paths, manifest, dispatch_file, walked), false);
+            if(walkers > 0) perf.setWalk(walkers, walked);
+        }
+        else
+        {
+            vector<string *> filenames;
+
+            if(listed != NULL) filenames.swap(*listed);
             else
             {
-                first = false;
+                iwm::listing::batch(imgdir, walkers, paths, manifest, filenames, walked);
+                if(walkers > 0) perf.setWalk(walkers, walked);
             }
 
-            auto l_start = perf.now();
-
-            iwm::Job *job = new iwm::Job();
-            job->setFilename(filepath);
-
-            job->setTcommEmitterStart(l_start);
+            // Dispatch order and estimated cost of every job
+            perf.setSchedule(iwm::order::sort(order, filenames), dispatch->workers());
+            perf.setProcessed(probed + filenames.size());
 
-            send_to_worker_rr(job, nWorkers, workers_queues);
+            for(string *filepath : filenames) dispatch_file(filepath);
         }
     }
     catch(exception &ex)
     {
         cerr << "Cannot open image directory " << imgdir << endl;
     }
+    // the dispatch never started
+    if(first) perf.setEmitterTime(start, perf.now());
 
     // Send EOS to all workers
-    send_to_all_workers(EOS, nWorkers, workers_queues);
+    dispatch->close();
 
 #ifdef VERBOSE
     cout << "Emitter ends! " << endl;
@@ -134,47 +320,30 @@ void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *wor
 /**
  * Stage 1: load the image from the disk
  */
-void stage1(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+template <typename Out>
+void stage1(iwm::dispatcher *dispatch, int idx, Out *output_queue, pool_t *pool)
 {
 #ifdef VERBOSE
     cout << "Stage 1 starts! " << endl;
 #endif
 
-    iwm::Job *job = input_queue->pop();
+    iwm::Job *job = dispatch->pop(idx);
     while(job != EOS)
     {
-        try
+        if(load_job(job, idx))
         {
-            auto l_start = perf.now();
-
-            string *filepath = job->getFilename();
-            cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>(filepath->c_str());
-
-            job->setImage(image);
-
-            auto l_stop = perf.now();
-
-            job->setLatencyStart(l_start);
-            job->setTcommEmitterEnd(l_start);
-            job->setLatencyStage1(l_start, l_stop);
-
             job->setTcommStage1Start(perf.now());
 
             output_queue->push(job);
         }
-        catch(cimg_library::CImgIOException &ex)
-        {
-#ifdef VERBOSE
-            cerr << "Cannot load " << job->getFilename() << endl;
-#endif
-        }
+        else recycle(job);
 
         // Take another job
-        job = input_queue->pop();
+        job = dispatch->pop(idx);
     }
 
     // Forwarding the EOS
-    output_queue->push(EOS);
+    forward_eos(pool, output_queue);
 
 #ifdef VERBOSE
     cout << "Stage 1 ends! " << endl;
@@ -184,7 +353,8 @@ void stage1(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 /**
  * Stage 2: apply the mark
  */
-void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+template <typename In, typename Out>
+void stage2(In *input_queue, Out *output_queue, pool_t *pool)
 {
 #ifdef VERBOSE
     cout << "Stage 2 starts!" << endl;
@@ -196,8 +366,7 @@ void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
         auto l_start = perf.now();
         
         // Apply the transformation
-        cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
-        iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height());
+        stamp_job(job, input_queue->size());
 
         // Send the job to the third stage
 #ifdef VERBOSE
@@ -217,7 +386,7 @@ void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
     }
 
     // Forwarding the EOS
-    output_queue->push(job);
+    forward_eos(pool, output_queue);
 
 #ifdef VERBOSE
     cout << "Stage 2 ends!" << endl;
@@ -227,7 +396,8 @@ void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 /**
  * Stage 3: Store the image to the disk
  */
-void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+template <typename In>
+void stage3(In *input_queue, mpmc_queue<iwm::Job *> *output_queue, pool_t *pool)
 {
 #ifdef VERBOSE
     cout << "Stage 3 starts! " << endl;
@@ -240,27 +410,7 @@ void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 #ifdef VERBOSE
         cout << "Worker store the image" << endl;
 #endif
-        auto l_start = perf.now();
-
-        cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
-        string *path = job->getFilename();
-
-        string newfilename = iwm::get_new_filename(*path);
-
-        try
-        {
-            image->save(newfilename.c_str());
-        }
-        catch(cimg_library::CImgIOException &ex)
-        {
-#ifdef VERBOSE
-            cerr << "Cannot store the image" << path << endl;
-#endif
-        }
-
-        auto l_stop = perf.now();
-        job->setTcommStage2End(l_start);
-        job->setLatencyStage3(l_start, l_stop);
+        store_job(job);
 
         job->setTcommStage3Start(perf.now());
 
@@ -270,22 +420,105 @@ void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
         job = input_queue->pop();
     }
     // Forwarding the EOS
-    output_queue->push(job);
+    forward_eos(pool, output_queue);
 
 #ifdef VERBOSE
     cout << "Stage 3 ends!" << endl;
 #endif
 }
 
+/**
+ * Probe: runs the first n jobs through the three stages in this thread to
+ * measure the average service time of each stage, and removes them from
+ * the files. The jobs stay out of the farm statistics; returns how many
+ * were processed.
+ */
+int probe(vector<string *> &filenames, int n, double latency[3])
+{
+    n = min(n, (int)filenames.size());
+    vector<perf_entry_t> entries;
+    for(int i = 0; i < n; i++)
+    {
+        iwm::Job *job = jobs->get();
+        job->setFilename(filenames[i]);
+        if(!load_job(job, 0))
+        {
+            recycle(job);
+            continue;
+        }
+
+        auto l_start = perf.now();
+        stamp_job(job, 0);
+        job->setLatencyStage2(l_start, perf.now());
+
+        store_job(job);
+
+        job->setLatencyEnd(perf.now());
+        entries.push_back(job->getPerfEntry());
+
+        budget->release(job->getCharged());
+        // a failed output is rebuilt by the next incremental run
+        if(manifest != NULL && !job->isFailed()) manifest->done(*job->getFilename());
+        // the duplicates of a failed output are dropped with it
+        if(dedup != NULL && job->isFailed()) dedup->failed(*job->getFilename());
+        else if(dedup != NULL)
+        {
+            for(string *duplicate : dedup->done(*job->getFilename(), job->getPerfEntry().work()))
+            {
+                if(manifest != NULL) manifest->done(*duplicate);
+                delete duplicate;
+            }
+        }
+        if(arena != NULL) arena->release(job->getImage());
+        recycle(job);
+    }
+
+    filenames.erase(filenames.begin(), filenames.begin() + n);
+    iwm::performance::stageLatencies(entries, latency[0], latency[1], latency[2]);
+    return entries.size();
+}
+
+/**
+ * Splits the threads among the stages in proportion to their service
+ * times, at least one each
+ */
+void size_pools(int threads, const double latency[3], int workers[3])
+{
+    const double total = latency[0] + latency[1] + latency[2];
+    const int spare = max(threads - 3, 0);
+
+    double remainder[3];
+    int given = 0;
+    for(int i = 0; i < 3; i++)
+    {
+        const double share = total > 0 ? spare * latency[i] / total : spare / 3.0;
+        workers[i] = 1 + (int)share;
+        remainder[i] = share - (int)share;
+        given += workers[i] - 1;
+    }
+
+    // largest remainders first
+    for(; given < spare; given++)
+    {
+        int best = 0;
+        for(int i = 1; i < 3; i++)
+        {
+            if(remainder[i] > remainder[best]) best = i;
+        }
+        workers[best]++;
+        remainder[best] = -1;
+    }
+}
+
 /**
  * Collector: collects jobs and update performances results
  */
-void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
+void collector(int workers, mpmc_queue<iwm::Job *> *input_queue)
 {
 #ifdef VERBOSE
     cout << "Collector starts! " << endl;
 #endif
-    int remaining_workers = degree;
+    int remaining_workers = workers;
 
     iwm::Job *job = NULL;
     while(remaining_workers > 0)
@@ -302,7 +535,21 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
 
             perf.registerJob(job);
 
-            delete job;
+            budget->release(job->getCharged());
+            // a failed output is rebuilt by the next incremental run
+            if(manifest != NULL && !job->isFailed()) manifest->done(*job->getFilename());
+            // the duplicates of a failed output are dropped with it
+            if(dedup != NULL && job->isFailed()) dedup->failed(*job->getFilename());
+            else if(dedup != NULL)
+            {
+                for(string *duplicate : dedup->done(*job->getFilename(), job->getPerfEntry().work()))
+                {
+                    if(manifest != NULL) manifest->done(*duplicate);
+                    delete duplicate;
+                }
+            }
+            if(arena != NULL) arena->release(job->getImage());
+            recycle(job);
         }
         else
         {
@@ -320,9 +567,9 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
  */
 int main(int argc, char **argv)
 {
-    if (argc < 4)
+    if (argc < 5)
     {
-        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay>" << endl;
+        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes] [--map <workers>] [--map-queue <jobs>] [--dispatch rr|shared|steal|ondemand] [--backlog <jobs>] [--order readdir|size|lpt] [--list stream|batch] [--recursive] [--walkers <threads>] [--incremental [<manifest>]] [--dedup] [--queue-cap <jobs>] [--budget <MB>] [--arena off|thp|explicit] [--pool <images>] [--load <workers>] [--stamp <workers>] [--store <workers>] [--pools auto] [--probe <jobs>] [--wait spin|yield|park]" << endl;
         return 0;
     }
 
@@ -330,6 +577,31 @@ int main(int argc, char **argv)
     string imgDir = argv[2];
     string stampFilename = argv[3];
     int delay = atoi(argv[4]);
+    iwm::options opts(argc, argv, 5);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
+    int map_workers = opts.getInt("map", 0);
+    map_queue = opts.getInt("map-queue", 0);
+    string dispatch_name = opts.get("dispatch", "rr");
+    int backlog = opts.getInt("backlog", 1);
+    string order = opts.get("order", "readdir");
+    int queue_cap = opts.getInt("queue-cap", 0);
+    int budget_mb = opts.getInt("budget", 0);
+    string arena_mode = opts.get("arena", "off");
+    // jobs, paths and decoded images kept for reuse (0: allocate them for every image)
+    int pool_size = opts.getInt("pool", 4 * degree);
+    // stage pools instead of degree 1:1:1 pipelines
+    bool auto_pools = opts.get("pools", "") == "auto";
+    bool pools = auto_pools || opts.has("load") || opts.has("stamp") || opts.has("store");
+    int workers[3] = { opts.getInt("load", degree), opts.getInt("stamp", degree), opts.getInt("store", degree) };
+    int probe_jobs = opts.getInt("probe", 2);
+    // only the directory order can be dispatched before the listing ends,
+    // and the probe needs the whole listing
+    string list = opts.get("list", order == "readdir" && !auto_pools ? "stream" : "batch");
+    // walk the subdirectories too, with walkers threads
+    int walkers = opts.has("recursive") ? opts.getInt("walkers", 2) : 0;
+    string wait_name = opts.get("wait", "park");
+    wait_strategy wait;
 
     if(degree < 1)
     {
@@ -354,10 +626,91 @@ int main(int argc, char **argv)
         delay = 0;
     }
 
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
+    if(!parse_wait_strategy(wait_name, wait))
+    {
+        cerr << "unsupported wait strategy: " << wait_name << endl;
+        return 1;
+    }
+
+    if(map_workers < 0)
+    {
+        cerr << "invalid map workers: " << map_workers << endl;
+        return 1;
+    }
+
+    if(!iwm::order::valid(order))
+    {
+        cerr << "unsupported order: " << order << endl;
+        return 1;
+    }
+
+    if((list != "stream" && list != "batch") || (list == "stream" && (order != "readdir" || auto_pools)))
+    {
+        cerr << "unsupported list: " << list << " (stream needs --order readdir and no --pools auto)" << endl;
+        return 1;
+    }
+    bool stream = list == "stream";
+
+    if(opts.has("recursive") && walkers < 1)
+    {
+        cerr << "invalid walkers: " << walkers << endl;
+        return 1;
+    }
+
+    if(queue_cap < 0 || budget_mb < 0 || pool_size < 0)
+    {
+        cerr << "invalid queue capacity, memory budget or pool size" << endl;
+        return 1;
+    }
+
+    if(arena_mode != "off" && arena_mode != "thp" && arena_mode != "explicit")
+    {
+        cerr << "unsupported arena: " << arena_mode << endl;
+        return 1;
+    }
+
+    if(backlog < 1)
+    {
+        cerr << "invalid backlog: " << backlog << endl;
+        return 1;
+    }
+
+    if(opts.has("pools") && !auto_pools)
+    {
+        cerr << "unsupported pools: " << opts.get("pools", "") << endl;
+        return 1;
+    }
+
+    if(workers[0] < 1 || workers[1] < 1 || workers[2] < 1 || probe_jobs < 1)
+    {
+        cerr << "invalid stage workers or probe jobs" << endl;
+        return 1;
+    }
+
+    if(!iwm::dispatcher::valid(dispatch_name))
+    {
+        cerr << "unsupported dispatch: " << dispatch_name << endl;
+        return 1;
+    }
+
 #ifdef VERBOSE
     cout << "degree: " << degree << endl;
     cout << "imgDir: " << imgDir << endl;
     cout << "stampFilename: " << stampFilename << endl;
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
     cout << "delay: " << delay << endl;
 #endif
 
@@ -369,7 +722,7 @@ int main(int argc, char **argv)
     // Prepare stamp image
     try
     {
-        stamp = cimg_library::CImg<CIMG_TYPE>(stampFilename.c_str());
+        iwm::codec::load(stampFilename, stamp);
     }
     catch (cimg_library::CImgIOException &ex)
     {
@@ -377,6 +730,21 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // Inputs whose output is up to date with this stamp are skipped
+    string manifest_path = opts.get("incremental", "");
+    if(opts.has("incremental"))
+    {
+        uint64_t stamp_hash = 0;
+        iwm::hash::file(stampFilename, stamp_hash);
+        if(manifest_path.empty()) manifest_path = imgDir + MANIFEST_NAME;
+        manifest = new iwm::manifest(manifest_path, stamp_hash);
+    }
+
+    // Compile the stamp into its span index or packed mask
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    const iwm::fitted_stamp_t &native = stamps->fit(stamp.width(), stamp.height());
+    const iwm::span_index *spans = native.spans;
+
     auto stamp_end = perf.now();
 #ifdef VERBOSE
     cout << "Done!" << endl;
@@ -385,30 +753,94 @@ int main(int argc, char **argv)
 #endif
 
     auto setup_start = perf.now();
+    const long allocations = iwm::alloc_counter::calls();
     // Setting up the farm
 
+    jobs = new iwm::object_pool<iwm::Job>(pool_size);
+    paths = new iwm::object_pool<string>(pool_size);
+    images = new iwm::image_pool(pool_size);
+    budget = new iwm::memory_budget((size_t)budget_mb << 20, images);
+
+    // Byte-identical inputs share the output of the first of them
+    if(opts.has("dedup")) dedup = new iwm::dedup_cache();
+
+    // Decoded images in huge pages, pre-faulted by each load worker
+    if(arena_mode != "off") arena = new iwm::huge_arena(degree, arena_mode == "explicit");
+
+    // Band workers shared by the farm workers
+    if(map_workers > 0) bands = new iwm::band_map(map_workers);
+
+    // Size the pools from the service times of the first jobs, with the
+    // threads of the 1:1:1 pipelines
+    int probed = 0;
+    double probe_latency[3] = { 0, 0, 0 };
+    vector<string *> *listed = NULL;
+    auto probe_start = perf.now(), probe_end = probe_start;
+    if(auto_pools)
+    {
+        // list the files once: the probe writes its outputs in the directory
+        listed = new vector<string *>();
+        try
+        {
+            long walked;
+            iwm::listing::batch(imgDir, walkers, paths, manifest, *listed, walked);
+            if(walkers > 0) perf.setWalk(walkers, walked);
+        }
+        catch(exception &ex)
+        {
+            cerr << "Cannot open image directory " << imgDir << endl;
+        }
+        iwm::order::sort(order, *listed);
+
+        probed = probe(*listed, probe_jobs, probe_latency);
+        probe_end = perf.now();
+        size_pools(3 * degree, probe_latency, workers);
+    }
+
+    const int farm = pools ? workers[0] : degree;
+    iwm::dispatcher *dispatch = iwm::dispatcher::create(dispatch_name, farm, wait, backlog, queue_cap);
+
+    mpmc_queue<iwm::Job *> *collector_queue = new mpmc_queue<iwm::Job *>(MPMC_CAPACITY, wait);
+    vector<thread *> threads;
+
     // preparing the pipelines
-    blocking_queue<iwm::Job *> **stage1_queue = new blocking_queue<iwm::Job *> *[degree];
-    blocking_queue<iwm::Job *> *stage2_queue[degree];
-    blocking_queue<iwm::Job *> *stage3_queue[degree];
-    thread *stage1_workers[degree];
-    thread *stage2_workers[degree];
-    thread *stage3_workers[degree];
+    vector<spsc_queue<iwm::Job *> *> stage_queues;
 
-    blocking_queue<iwm::Job *> *collector_queue = new blocking_queue<iwm::Job *>();
+    // or the pools, linked by shared queues
+    mpmc_queue<iwm::Job *> *stage2_pool_queue = NULL;
+    mpmc_queue<iwm::Job *> *stage3_pool_queue = NULL;
+    pool_t *stage_pools[3] = { NULL, NULL, NULL };
 
-    for(int i = 0; i < degree; i++)
+    if(pools)
     {
-        stage1_queue[i] = new blocking_queue<iwm::Job *>();
-        stage2_queue[i] = new blocking_queue<iwm::Job *>();
-        stage3_queue[i] = new blocking_queue<iwm::Job *>();
-        stage1_workers[i] = new thread(stage1, stage1_queue[i], stage2_queue[i]);
-        stage2_workers[i] = new thread(stage2, stage2_queue[i], stage3_queue[i]);
-        stage3_workers[i] = new thread(stage3, stage3_queue[i], collector_queue);
+        const size_t capacity = queue_cap > 0 ? queue_cap : MPMC_CAPACITY;
+        stage2_pool_queue = new mpmc_queue<iwm::Job *>(capacity, wait);
+        stage3_pool_queue = new mpmc_queue<iwm::Job *>(capacity, wait);
+        stage_pools[0] = new pool_t(workers[0], workers[1]);
+        stage_pools[1] = new pool_t(workers[1], workers[2]);
+        stage_pools[2] = new pool_t(workers[2], 1);
+
+        for(int i = 0; i < workers[0]; i++) threads.push_back(new thread(stage1<mpmc_queue<iwm::Job *>>, dispatch, i, stage2_pool_queue, stage_pools[0]));
+        for(int i = 0; i < workers[1]; i++) threads.push_back(new thread(stage2<mpmc_queue<iwm::Job *>, mpmc_queue<iwm::Job *>>, stage2_pool_queue, stage3_pool_queue, stage_pools[1]));
+        for(int i = 0; i < workers[2]; i++) threads.push_back(new thread(stage3<mpmc_queue<iwm::Job *>>, stage3_pool_queue, collector_queue, stage_pools[2]));
+    }
+    else
+    {
+        for(int i = 0; i < degree; i++)
+        {
+            spsc_queue<iwm::Job *> *stage2_queue = new spsc_queue<iwm::Job *>(queue_cap > 0 ? queue_cap : SPSC_CAPACITY, wait);
+            spsc_queue<iwm::Job *> *stage3_queue = new spsc_queue<iwm::Job *>(queue_cap > 0 ? queue_cap : SPSC_CAPACITY, wait);
+            stage_queues.push_back(stage2_queue);
+            stage_queues.push_back(stage3_queue);
+
+            threads.push_back(new thread(stage1<spsc_queue<iwm::Job *>>, dispatch, i, stage2_queue, (pool_t *)NULL));
+            threads.push_back(new thread(stage2<spsc_queue<iwm::Job *>, spsc_queue<iwm::Job *>>, stage2_queue, stage3_queue, (pool_t *)NULL));
+            threads.push_back(new thread(stage3<spsc_queue<iwm::Job *>>, stage3_queue, collector_queue, (pool_t *)NULL));
+        }
     }
 
-    thread th_collector = thread(collector, degree, collector_queue);
-    thread th_emitter = thread(emitter, imgDir, degree, stage1_queue, delay);
+    thread th_collector = thread(collector, pools ? 1 : degree, collector_queue);
+    thread th_emitter = thread(emitter, imgDir, order, stream, walkers, dispatch, delay, listed, probed);
 
     auto setup_end = perf.now();
 
@@ -425,41 +857,55 @@ int main(int argc, char **argv)
     // Waiting for termination
     th_emitter.join();
 
-    for(int i = 0; i < degree; i++)
+    for(thread *worker : threads)
     {
-        stage1_workers[i]->join();
+        worker->join();
     }
 
-    for(int i = 0; i < degree; i++)
+    th_collector.join();
+    perf.setPools({ jobs->hits(), jobs->misses() }, { paths->hits(), paths->misses() }, { images->hits(), images->misses() }, iwm::alloc_counter::calls() - allocations);
+
+    if(manifest != NULL && !manifest->save()) cerr << "Cannot write the manifest " << manifest_path << endl;
+    if(dedup != NULL) perf.setDedup(dedup->hits(), dedup->misses(), dedup->saved(), dedup->hashing());
+
+    // Free resources
+    for(thread *worker : threads)
     {
-        stage2_workers[i]->join();
+        delete worker;
     }
 
-    for(int i = 0; i < degree; i++)
+    for(spsc_queue<iwm::Job *> *queue : stage_queues)
     {
-        stage3_workers[i]->join();
+        delete queue;
     }
 
-    th_collector.join();
-
-    // Free resources
-    for(int i = 0; i < degree; i++)
+    delete listed;
+    delete stage2_pool_queue;
+    delete stage3_pool_queue;
+    for(pool_t *pool : stage_pools)
     {
-        delete stage1_queue[i];
-        delete stage2_queue[i];
-        delete stage3_queue[i];
-
-        delete stage1_workers[i];
-        delete stage2_workers[i];
-        delete stage3_workers[i];
+        delete pool;
     }
 
-    delete[] stage1_queue;
+    perf.setWorkerStats(dispatch->stats());
+    delete dispatch;
     delete collector_queue;
 
+    delete bands;
+
+    perf.setMemory(budget->limit(), budget->peak(), budget->waits());
+    delete budget;
+    delete jobs;
+    delete paths;
+    delete images;
+
     auto end = perf.now();
 
     perf.setStampTime(stamp_start, stamp_end);
+    if(spans != NULL) perf.setStampSpans(spans->count(), spans->coverage());
+    perf.setStampBox(native.left, native.top, native.right, native.bottom);
+    perf.setStampFits(stamps->size());
+    perf.setMapWorkers(map_workers);
     perf.setSetupTime(setup_start, setup_end);
     perf.setCompletionTime(start, end);
 
@@ -468,8 +914,29 @@ int main(int argc, char **argv)
     cout << "Version: par_pipe" << endl;
     cout << "Parallelism Degree: " << degree << endl;
     cout << "Delay: " << delay << endl;
+    cout << "Kernel: " << iwm::kernel::active << endl;
+    cout << "Mask: " << mask << endl;
+    cout << "Map queue: " << map_queue << endl;
+    cout << "Dispatch: " << dispatch_name << endl;
+    if(dispatch_name == "ondemand") cout << "Backlog: " << backlog << endl;
+    cout << "Order: " << order << endl;
+    cout << "List: " << (stream ? "stream" : "batch") << endl;
+    if(manifest != NULL) cout << "Incremental: " << manifest->fresh() << " up to date (" << manifest_path << ")" << endl;
+    cout << "Queue capacity: " << queue_cap << endl;
+    cout << "Pool: " << pool_size << endl;
+    cout << "Arena: " << arena_mode;
+    if(arena != NULL) cout << " (" << arena->mapped() << " regions mapped, " << arena->reused() << " reused, " << arena->fallbacks() << " explicit fallbacks)";
+    cout << endl;
+    if(pools) cout << "Pools: load " << workers[0] << ", stamp " << workers[1] << ", store " << workers[2] << (auto_pools ? " (auto)" : "") << endl;
+    else cout << "Pools: none (" << degree << " 1:1:1 pipelines)" << endl;
+    if(auto_pools) cout << "Probe: " << probed << " jobs in " << chrono::duration<double, milli>(probe_end - probe_start).count() << " ms, L S1/S2/S3 " << probe_latency[0] << "/" << probe_latency[1] << "/" << probe_latency[2] << endl;
+    cout << "Wait: " << wait_name << endl;
     perf.print();
 
+    delete arena;
+    delete manifest;
+    delete dedup;
+
     cout << "Done!" << endl;
 
     return 0;
@@ -12,9 +12,22 @@
 // #define VERBOSE
 
 #include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
 #include "class/blocking_queue.cpp"
+#include "class/mpmc_queue.cpp"
+#include "class/band_map.cpp"
 #include "class/performance.cpp"
 #include "class/job.cpp"
+#include "class/dispatch.cpp"
+#include "class/order.cpp"
+#include "class/memory_budget.cpp"
+#include "class/pool.cpp"
+#include "class/alloc_counter.cpp"
+#include "class/preloader.cpp"
+#include "class/manifest.cpp"
+#include "class/listing.cpp"
 #include "lib/CImg/CImg.h"
 
 using namespace std;
@@ -39,102 +52,148 @@ bool file_exists(const string &path)
 iwm::performance perf;
 
 /**
- * Send job to the worker i
+ * Global accounting of the decoded images
  */
-void send_to_worker(iwm::Job *job, int worker_idx, blocking_queue<iwm::Job *> *workers_queues[])
-{
-#ifdef VERBOSE
-    if(job != NULL) cout << "send_to_worker: " << *job->getFilename() << ", idx: " << worker_idx << endl;
-#endif
-    workers_queues[worker_idx]->push(job);
-}
+iwm::memory_budget *budget = NULL;
 
 /**
- * Send the job to all workers
+ * Global pools of the jobs, the paths and the decoded images, handed back
+ * by the collector to the emitter and the loaders
  */
-void send_to_all_workers(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+iwm::object_pool<iwm::Job> *jobs = NULL;
+iwm::object_pool<string> *paths = NULL;
+iwm::image_pool *images = NULL;
+
+/**
+ * Global loaders, fed by the emitter with the files as they are listed
+ */
+iwm::preloader *preload = NULL;
+
+/**
+ * Global manifest of the incremental mode, NULL to process every input
+ */
+iwm::manifest *manifest = NULL;
+
+/**
+ * Global map workers, NULL if images are not split
+ */
+iwm::band_map *bands = NULL;
+
+/**
+ * Images are split in bands when at most map_queue other images wait for
+ * the worker (-1: always)
+ */
+int map_queue = 0;
+
+/**
+ * Applies the stamp to the image of the job, backlog jobs wait for the worker
+ */
+void stamp_job(iwm::Job *job, size_t backlog)
 {
-    for(int i = 0; i < nWorkers; i++)
+    cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
+
+    if(bands != NULL && (map_queue < 0 || (int)backlog <= map_queue))
+    {
+        job->setMapped(true);
+        job->setStamped(bands->print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
+    }
+    else
     {
-        send_to_worker(job, i, workers_queues);
+        job->setStamped(iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height()));
     }
 }
 
 /**
- * Send the job to workers in a round robin way
+ * Lister: hand the files to the loaders in directory order, as they are read
  */
-int next_worker_idx = -1;
-void send_to_worker_rr(iwm::Job *job, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[])
+void lister(const string &imgdir)
 {
-    next_worker_idx = (next_worker_idx + 1) % nWorkers;
-    send_to_worker(job, next_worker_idx, workers_queues);
+    try
+    {
+        long walked;
+        perf.setProcessed(iwm::listing::stream(imgdir, 0, paths, manifest, [](string *filepath) { preload->add(filepath); }, walked), false);
+    }
+    catch(exception &ex)
+    {
+        cerr << "Error opening image directory " << imgdir << endl;
+    }
+
+    preload->close();
 }
 
 /**
- * Emitter: Load the image and send it to the workers
+ * Emitter: hand the images to the workers as the loaders decode them
  */
-void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *workers_queues[], int delay)
+void emitter(const string &imgdir, const string &order, iwm::dispatcher *dispatch, int delay)
 {
 #ifdef VERBOSE
     cout << "Emitter starts! " << endl;
 #endif
-    try
-    {
-        auto start = perf.now();
-        vector<string *> filenames;
-
-        iwm::read_filenames(imgdir, filenames);
-
-        vector<iwm::Job *> jobs;
-        jobs.reserve(filenames.size());
+    auto start = perf.now();
+    thread *reader = NULL;
 
-        // Load all images
-        for(string *filepath : filenames)
+    if(order == "readdir")
+    {
+        // the loaders start on the first file listed
+        reader = new thread(lister, imgdir);
+    }
+    else
+    {
+        try
         {
-            cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>(filepath->c_str());
+            vector<string *> filenames;
+            long walked;
+            iwm::listing::batch(imgdir, 0, paths, manifest, filenames, walked);
 
-            iwm::Job *job = new iwm::Job();
-            job->setFilename(filepath);
-            job->setImage(image);
+            // Dispatch order and estimated cost of every job
+            perf.setSchedule(iwm::order::sort(order, filenames), dispatch->workers());
+            perf.setProcessed(filenames.size());
 
-            jobs.push_back(job);
+            for(string *filepath : filenames) preload->add(filepath);
         }
+        catch(exception &ex)
+        {
+            cerr << "Error opening image directory " << imgdir << endl;
+        }
+        preload->close();
+    }
 
-        auto stop = perf.now();
-
-        perf.setProcessed(filenames.size());
-        perf.setEmitterTime(start, stop);
-
-        bool first = true;
-        for(iwm::Job* job : jobs)
+    bool first = true;
+    iwm::Job *job;
+    while((job = preload->next()) != NULL)
+    {
+        // retard the dispatch of the filename
+        if(!first)
         {
-            // retard the dispatch of the filename
-            if(!first)
-            {
 #ifdef VERBOSE
-                cout << "retard dispatch by " << delay << "ms" << endl;
+            cout << "retard dispatch by " << delay << "ms" << endl;
 #endif
-                if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
-            }
-            else
-            {
-                first = false;
-            }
+            if(delay > 0) std::this_thread::sleep_for (std::chrono::milliseconds(delay));
+        }
+        else
+        {
+            // the emitter only waits for the first image before the dispatch starts
+            perf.setEmitterTime(start, perf.now());
+            first = false;
+        }
 
-            auto l_start = perf.now();
+        auto l_start = perf.now();
 
-            job->setTcommEmitterStart(l_start);
+        job->setTcommEmitterStart(l_start);
 
-            send_to_worker_rr(job, nWorkers, workers_queues);
-        }
+        dispatch->push(job);
     }
-    catch(exception &ex)
+    // the dispatch never started
+    if(first) perf.setEmitterTime(start, perf.now());
+
+    if(reader != NULL)
     {
-        cerr << "Error opening image directory " << imgdir << endl;
+        reader->join();
+        delete reader;
     }
 
     // Send EOS to all workers
-    send_to_all_workers(EOS, nWorkers, workers_queues);
+    dispatch->close();
 
 #ifdef VERBOSE
     cout << "Emitter ends! " << endl;
@@ -144,20 +203,19 @@ void emitter(const string &imgdir, int nWorkers, blocking_queue<iwm::Job *> *wor
 /**
  * Stage 2: apply the mark
  */
-void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+void stage2(iwm::dispatcher *dispatch, int idx, blocking_queue<iwm::Job *> *output_queue)
 {
 #ifdef VERBOSE
     cout << "Stage 2 starts!" << endl;
 #endif
 
-    iwm::Job *job = input_queue->pop();
+    iwm::Job *job = dispatch->pop(idx);
     while(job != EOS)
     {
         auto l_start = perf.now();
 
         // Apply the transformation
-        cimg_library::CImg<CIMG_TYPE> *image = job->getImage();
-        iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height());
+        stamp_job(job, dispatch->backlog(idx));
 
         // Send the job to the third stage
 #ifdef VERBOSE
@@ -174,7 +232,7 @@ void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
         output_queue->push(job);
 
         // Take another job
-        job = input_queue->pop();
+        job = dispatch->pop(idx);
     }
 
     // Forwarding the EOS
@@ -188,7 +246,7 @@ void stage2(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 /**
  * Stage 3: Store the image to the disk
  */
-void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *> *output_queue)
+void stage3(blocking_queue<iwm::Job *> *input_queue, mpmc_queue<iwm::Job *> *output_queue)
 {
 #ifdef VERBOSE
     cout << "Stage 3 starts! " << endl;
@@ -210,13 +268,16 @@ void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 
         try
         {
-            image->save(newfilename.c_str());
+            // an untouched image does not need to be encoded again
+            if(job->isStamped()) iwm::codec::save(*image, newfilename);
+            else iwm::codec::copy(*path, newfilename);
         }
         catch(cimg_library::CImgIOException &ex)
         {
 #ifdef VERBOSE
             cerr << "Cannot store the image" << path << endl;
 #endif
+            job->setFailed(true);
         }
 
         auto l_stop = perf.now();
@@ -238,10 +299,26 @@ void stage3(blocking_queue<iwm::Job *> *input_queue, blocking_queue<iwm::Job *>
 #endif
 }
 
+/**
+ * Gives the path, the image and the job back to their pools
+ */
+void recycle(iwm::Job *job)
+{
+    string *filepath = job->getFilename();
+    if(filepath != NULL)
+    {
+        filepath->clear();
+        paths->put(filepath);
+    }
+    images->put(job->getImage());
+    job->reset();
+    jobs->put(job);
+}
+
 /**
  * Collector: collects jobs and update performances results
  */
-void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
+void collector(int degree, mpmc_queue<iwm::Job *> *input_queue)
 {
 #ifdef VERBOSE
     cout << "Collector starts! " << endl;
@@ -263,7 +340,12 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
 
             perf.registerJob(job);
 
-            delete job;
+            // a failed output is rebuilt by the next incremental run
+            if(manifest != NULL && !job->isFailed()) manifest->done(*job->getFilename());
+            budget->release(job->getCharged());
+            recycle(job);
+
+            preload->done();
         }
         else
         {
@@ -281,9 +363,9 @@ void collector(int degree, blocking_queue<iwm::Job *> *input_queue)
  */
 int main(int argc, char **argv)
 {
-    if (argc < 4)
+    if (argc < 5)
     {
-        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay>" << endl;
+        cout << ": usage: <par_degree> <imgDir> <stampFilename> <delay> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes] [--map <workers>] [--map-queue <jobs>] [--dispatch rr|shared|steal|ondemand] [--backlog <jobs>] [--order readdir|size|lpt] [--queue-cap <jobs>] [--budget <MB>] [--pool <images>] [--window <images>] [--loaders <threads>] [--incremental [<manifest>]] [--wait spin|yield|park]" << endl;
         return 0;
     }
 
@@ -291,6 +373,22 @@ int main(int argc, char **argv)
     string imgDir = argv[2];
     string stampFilename = argv[3];
     int delay = atoi(argv[4]);
+    iwm::options opts(argc, argv, 5);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
+    int map_workers = opts.getInt("map", 0);
+    map_queue = opts.getInt("map-queue", 0);
+    string dispatch_name = opts.get("dispatch", "rr");
+    int backlog = opts.getInt("backlog", 1);
+    string order = opts.get("order", "readdir");
+    int queue_cap = opts.getInt("queue-cap", 0);
+    int budget_mb = opts.getInt("budget", 0);
+    // jobs, paths and decoded images kept for reuse (0: allocate them for every image)
+    int pool_size = opts.getInt("pool", 4 * degree);
+    int window = opts.getInt("window", 2 * degree);
+    int loaders = opts.getInt("loaders", 2);
+    string wait_name = opts.get("wait", "park");
+    wait_strategy wait;
 
     if(degree < 1)
     {
@@ -315,10 +413,67 @@ int main(int argc, char **argv)
         delay = 0;
     }
 
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
+    if(!parse_wait_strategy(wait_name, wait))
+    {
+        cerr << "unsupported wait strategy: " << wait_name << endl;
+        return 1;
+    }
+
+    if(map_workers < 0)
+    {
+        cerr << "invalid map workers: " << map_workers << endl;
+        return 1;
+    }
+
+    if(!iwm::order::valid(order))
+    {
+        cerr << "unsupported order: " << order << endl;
+        return 1;
+    }
+
+    if(queue_cap < 0 || budget_mb < 0 || pool_size < 0)
+    {
+        cerr << "invalid queue capacity, memory budget or pool size" << endl;
+        return 1;
+    }
+
+    if(window < 1 || loaders < 1)
+    {
+        cerr << "invalid preload window or loaders" << endl;
+        return 1;
+    }
+
+    if(backlog < 1)
+    {
+        cerr << "invalid backlog: " << backlog << endl;
+        return 1;
+    }
+
+    iwm::dispatcher *dispatch = iwm::dispatcher::create(dispatch_name, degree, wait, backlog, queue_cap);
+    if(dispatch == NULL)
+    {
+        cerr << "unsupported dispatch: " << dispatch_name << endl;
+        return 1;
+    }
+
 #ifdef VERBOSE
     cout << "degree: " << degree << endl;
     cout << "imgDir: " << imgDir << endl;
     cout << "stampFilename: " << stampFilename << endl;
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
     cout << "delay: " << delay << endl;
 #endif
 
@@ -330,7 +485,7 @@ int main(int argc, char **argv)
     // Prepare stamp image
     try
     {
-        stamp = cimg_library::CImg<CIMG_TYPE>(stampFilename.c_str());
+        iwm::codec::load(stampFilename, stamp);
     }
     catch (cimg_library::CImgIOException &ex)
     {
@@ -338,6 +493,21 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // Inputs whose output is up to date with this stamp are skipped
+    string manifest_path = opts.get("incremental", "");
+    if(opts.has("incremental"))
+    {
+        uint64_t stamp_hash = 0;
+        iwm::hash::file(stampFilename, stamp_hash);
+        if(manifest_path.empty()) manifest_path = imgDir + MANIFEST_NAME;
+        manifest = new iwm::manifest(manifest_path, stamp_hash);
+    }
+
+    // Compile the stamp into its span index or packed mask
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    const iwm::fitted_stamp_t &native = stamps->fit(stamp.width(), stamp.height());
+    const iwm::span_index *spans = native.spans;
+
     auto stamp_end = perf.now();
 #ifdef VERBOSE
     cout << "Done!" << endl;
@@ -346,26 +516,36 @@ int main(int argc, char **argv)
 #endif
 
     auto setup_start = perf.now();
+    const long allocations = iwm::alloc_counter::calls();
     // Setting up the farm
 
+    jobs = new iwm::object_pool<iwm::Job>(pool_size);
+    paths = new iwm::object_pool<string>(pool_size);
+    images = new iwm::image_pool(pool_size);
+    budget = new iwm::memory_budget((size_t)budget_mb << 20, images);
+
+    // Decode at most window images ahead of the collector
+    preload = new iwm::preloader(window, loaders, budget, jobs);
+
+    // Band workers shared by the farm workers
+    if(map_workers > 0) bands = new iwm::band_map(map_workers);
+
     // preparing the pipelines
-    blocking_queue<iwm::Job *> **stage2_queue = new blocking_queue<iwm::Job *> *[degree];
     blocking_queue<iwm::Job *> *stage3_queue[degree];
     thread *stage2_workers[degree];
     thread *stage3_workers[degree];
 
-    blocking_queue<iwm::Job *> *collector_queue = new blocking_queue<iwm::Job *>();
+    mpmc_queue<iwm::Job *> *collector_queue = new mpmc_queue<iwm::Job *>(MPMC_CAPACITY, wait);
 
     for(int i = 0; i < degree; i++)
     {
-        stage2_queue[i] = new blocking_queue<iwm::Job *>();
-        stage3_queue[i] = new blocking_queue<iwm::Job *>();
-        stage2_workers[i] = new thread(stage2, stage2_queue[i], stage3_queue[i]);
+        stage3_queue[i] = new blocking_queue<iwm::Job *>(queue_cap);
+        stage2_workers[i] = new thread(stage2, dispatch, i, stage3_queue[i]);
         stage3_workers[i] = new thread(stage3, stage3_queue[i], collector_queue);
     }
 
     thread th_collector = thread(collector, degree, collector_queue);
-    thread th_emitter = thread(emitter, imgDir, degree, stage2_queue, delay);
+    thread th_emitter = thread(emitter, imgDir, order, dispatch, delay);
 
     auto setup_end = perf.now();
 
@@ -393,23 +573,41 @@ int main(int argc, char **argv)
     }
 
     th_collector.join();
+    perf.setPools({ jobs->hits(), jobs->misses() }, { paths->hits(), paths->misses() }, { images->hits(), images->misses() }, iwm::alloc_counter::calls() - allocations);
+
+    if(manifest != NULL && !manifest->save()) cerr << "Cannot write the manifest " << manifest_path << endl;
 
     // Free resources
     for(int i = 0; i < degree; i++)
     {
-        delete stage2_queue[i];
         delete stage3_queue[i];
 
         delete stage2_workers[i];
         delete stage3_workers[i];
     }
 
-    delete[] stage2_queue;
+    perf.setWorkerStats(dispatch->stats());
+    delete dispatch;
     delete collector_queue;
 
+    double stall = preload->stall();
+    delete preload;
+
+    delete bands;
+
+    perf.setMemory(budget->limit(), budget->peak(), budget->waits());
+    delete budget;
+    delete jobs;
+    delete paths;
+    delete images;
+
     auto end = perf.now();
 
     perf.setStampTime(stamp_start, stamp_end);
+    if(spans != NULL) perf.setStampSpans(spans->count(), spans->coverage());
+    perf.setStampBox(native.left, native.top, native.right, native.bottom);
+    perf.setStampFits(stamps->size());
+    perf.setMapWorkers(map_workers);
     perf.setSetupTime(setup_start, setup_end);
     perf.setCompletionTime(start, end);
 
@@ -418,8 +616,22 @@ int main(int argc, char **argv)
     cout << "Version: par_preload" << endl;
     cout << "Parallelism Degree: " << degree << endl;
     cout << "Delay: " << delay << endl;
+    cout << "Kernel: " << iwm::kernel::active << endl;
+    cout << "Mask: " << mask << endl;
+    cout << "Map queue: " << map_queue << endl;
+    cout << "Dispatch: " << dispatch_name << endl;
+    if(dispatch_name == "ondemand") cout << "Backlog: " << backlog << endl;
+    cout << "Order: " << order << endl;
+    if(manifest != NULL) cout << "Incremental: " << manifest->fresh() << " up to date (" << manifest_path << ")" << endl;
+    cout << "Queue capacity: " << queue_cap << endl;
+    cout << "Pool: " << pool_size << endl;
+    cout << "Window: " << window << ", loaders: " << loaders << endl;
+    cout << "Preload stall: " << stall << endl;
+    cout << "Wait: " << wait_name << endl;
     perf.print();
 
+    delete manifest;
+
     cout << "Done!" << endl;
 
     return 0;
@@ -6,13 +6,17 @@
 #include <fstream>
 #include <vector>
 
-#define CIMG_TYPE unsigned char
 #define TIME_UNIT std::chrono::milliseconds
 #define TIME_UNIT_T "ms"
 
 // #define VERBOSE
 
 #include "iwm.cpp"
+#include "class/codec.cpp"
+#include "class/kernel.cpp"
+#include "class/options.cpp"
+#include "class/band_map.cpp"
+#include "class/manifest.cpp"
 #include "lib/CImg/CImg.h"
 
 using namespace std;
@@ -30,12 +34,16 @@ int main(int argc, char **argv)
 {
     if (argc < 3)
     {
-        cout << "usage: <imgDir> <stampFilename>" << endl;
+        cout << "usage: <imgDir> <stampFilename> [--kernel auto|scalar|sse4|avx2|avx512] [--mask spans|bits|bytes] [--map <workers>] [--incremental [<manifest>]]" << endl;
         return 0;
     }
 
     string imgDir = argv[1];
     string stampFilename = argv[2];
+    iwm::options opts(argc, argv, 3);
+    string kernel = opts.get("kernel", "auto");
+    string mask = opts.get("mask", "spans");
+    int map_workers = opts.getInt("map", 0);
 
     if(!file_exists(imgDir))
     {
@@ -49,9 +57,29 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if(!iwm::kernel::use(kernel))
+    {
+        cerr << "unsupported kernel: " << kernel << endl;
+        return 1;
+    }
+
+    if(mask != "spans" && mask != "bits" && mask != "bytes")
+    {
+        cerr << "unsupported mask: " << mask << endl;
+        return 1;
+    }
+
+    if(map_workers < 0)
+    {
+        cerr << "invalid map workers: " << map_workers << endl;
+        return 1;
+    }
+
 #ifdef VERBOSE
     cout << "imgDir: " << imgDir << endl;
     cout << "stampFilename: " << stampFilename << endl;
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
 #endif
 
     auto stamp_start = chrono::high_resolution_clock::now();
@@ -59,7 +87,7 @@ int main(int argc, char **argv)
     cimg_library::CImg<CIMG_TYPE> stamp;
     try
     {
-        stamp = cimg_library::CImg<CIMG_TYPE>(stampFilename.c_str());
+        iwm::codec::load(stampFilename, stamp);
     }
     catch (cimg_library::CImgIOException &e)
     {
@@ -67,6 +95,22 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // Inputs whose output is up to date with this stamp are skipped
+    string manifest_path = opts.get("incremental", "");
+    iwm::manifest *manifest = NULL;
+    if(opts.has("incremental"))
+    {
+        uint64_t stamp_hash = 0;
+        iwm::hash::file(stampFilename, stamp_hash);
+        if(manifest_path.empty()) manifest_path = imgDir + MANIFEST_NAME;
+        manifest = new iwm::manifest(manifest_path, stamp_hash);
+    }
+
+    // Compile the stamp into its span index or packed mask
+    iwm::stamp_cache *stamps = iwm::stamp_cache::compile(stamp, mask);
+    const iwm::fitted_stamp_t &native = stamps->fit(stamp.width(), stamp.height());
+    const iwm::span_index *spans = native.spans;
+
     auto stamp_end = chrono::high_resolution_clock::now();
 
     auto start_seq = chrono::high_resolution_clock::now();
@@ -75,6 +119,7 @@ int main(int argc, char **argv)
     try
     {
         iwm::read_filenames(imgDir, filenames);
+        if(manifest != NULL) manifest->filter(filenames);
     }
     catch(exception &ex)
     {
@@ -84,6 +129,9 @@ int main(int argc, char **argv)
 
     auto end_seq = chrono::high_resolution_clock::now();
 
+    // Band workers splitting the rows of every image
+    iwm::band_map *bands = map_workers > 0 ? new iwm::band_map(map_workers) : NULL;
+
     auto start = chrono::high_resolution_clock::now();
 
     for(string *filepath : filenames)
@@ -91,18 +139,22 @@ int main(int argc, char **argv)
         try
         {
             // Load the image
-            cimg_library::CImg<CIMG_TYPE> *image = new cimg_library::CImg<CIMG_TYPE>(filepath->c_str());
+            cimg_library::CImg<CIMG_TYPE> *image = iwm::codec::load(*filepath);
 
             // Apply the stamp
-            iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height());
+            bool stamped = bands != NULL ? bands->print_stamp(*image, stamp, 0, 0, image->width(), image->height())
+                                         : iwm::print_stamp(*image, stamp, 0, 0, image->width(), image->height());
 
             // Get the filename for the new file
             string newfile = iwm::get_new_filename(*filepath);
 
             // Store the new image
-            image->save(newfile.c_str());
+            // an untouched image does not need to be encoded again
+            if(stamped) iwm::codec::save(*image, newfile);
+            else iwm::codec::copy(*filepath, newfile);
 
             delete image;
+            if(manifest != NULL) manifest->done(*filepath);
 #ifdef VERBOSE
             cout << "Stored " << newfile << endl;
 #endif
@@ -117,15 +169,28 @@ int main(int argc, char **argv)
 
     auto end = chrono::high_resolution_clock::now();
 
+    delete bands;
+
+    if(manifest != NULL && !manifest->save()) cerr << "Cannot write the manifest " << manifest_path << endl;
+
     chrono::duration<double, milli> stamp_time = stamp_end - stamp_start;
     chrono::duration<double, milli> sequential_time = end_seq - start_seq;
     chrono::duration<double, milli> completion_time = end - start;
 
     // Print results
+    cout << "kernel: " << iwm::kernel::active << endl;
+    cout << "mask: " << mask << endl;
+    cout << "map workers: " << map_workers << endl;
+    if(manifest != NULL) cout << "incremental: " << manifest->fresh() << " up to date (" << manifest_path << ")" << endl;
     cout << "stamp time: " << stamp_time.count() << endl;
+    if(spans != NULL) cout << "stamp spans: " << spans->count() << " (coverage " << spans->coverage() * 100 << "%)" << endl;
+    cout << "stamp box: [" << native.left << ", " << native.right << ") x [" << native.top << ", " << native.bottom << ")" << endl;
+    cout << "stamp fits: " << stamps->size() << endl;
     cout << "sequential time: " << sequential_time.count() << endl;
     cout << "Tc: " << completion_time.count() << endl;
 
+    delete manifest;
+
     cout << "Done!" << endl;
     return 0;
 }
\ No newline at end of file